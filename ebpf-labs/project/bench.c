@@ -0,0 +1,381 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+
+#include "bench.h"
+#include "log.h"
+
+#define BENCH_PAYLOAD_LEN 64
+#define BENCH_SRC_PORT 40000
+#define BENCH_DST_PORT 8080
+
+struct bench_case {
+    const char *name;
+    int ipv6;
+    __u8 proto;
+    int new_flows; /* every packet belongs to a different flow */
+    int no_vip;    /* the packets are not addressed to a service */
+};
+
+static const struct bench_case bench_cases[] = {
+    {"udp4 known flow", 0, IPPROTO_UDP, 0}, {"udp4 new flows", 0, IPPROTO_UDP, 1},
+    {"tcp4 known flow", 0, IPPROTO_TCP, 0}, {"tcp4 new flows", 0, IPPROTO_TCP, 1},
+    {"udp6 known flow", 1, IPPROTO_UDP, 0}, {"udp6 new flows", 1, IPPROTO_UDP, 1},
+    {"tcp6 known flow", 1, IPPROTO_TCP, 0}, {"tcp6 new flows", 1, IPPROTO_TCP, 1},
+    {"udp4 not a VIP", 0, IPPROTO_UDP, 0, 1}, {"udp6 not a VIP", 1, IPPROTO_UDP, 0, 1},
+};
+
+static const char *xdp_action_str(__u32 action) {
+    switch (action) {
+    case XDP_ABORTED:
+        return "XDP_ABORTED";
+    case XDP_DROP:
+        return "XDP_DROP";
+    case XDP_PASS:
+        return "XDP_PASS";
+    case XDP_TX:
+        return "XDP_TX";
+    case XDP_REDIRECT:
+        return "XDP_REDIRECT";
+    default:
+        return "unknown";
+    }
+}
+
+static __u16 bench_ipv4_csum(const struct iphdr *iph) {
+    const __u16 *words = (const __u16 *)iph;
+    __u32 csum = 0;
+
+    for (int i = 0; i < sizeof(*iph) / 2; i++)
+        csum += words[i];
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+
+    return ~csum;
+}
+
+/* First service the packets of the case can be sent to */
+static const struct service_key *bench_find_service(const struct bench_case *bc,
+                                                    const struct bench_opts *opts) {
+    for (int i = 0; i < opts->services_count; i++) {
+        const struct service_key *svc = &opts->services[i];
+
+        if (svc->ipv6 == bc->ipv6 && svc->proto == bc->proto)
+            return svc;
+    }
+
+    return NULL;
+}
+
+/* Build an Ethernet frame of the given case towards the service, or towards an
+ * address out of the documentation ranges if `svc` is NULL. `flow` selects the
+ * client address, so different values give different flows.
+ */
+static __u32 bench_build_packet(__u8 *buf, const struct bench_case *bc,
+                                const struct service_key *svc, __u32 flow, int syn) {
+    __be16 dst_port = svc && svc->port ? svc->port : htons(BENCH_DST_PORT);
+    struct ethhdr *eth = (struct ethhdr *)buf;
+    __u32 l4_len = (bc->proto == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr)) +
+                   BENCH_PAYLOAD_LEN;
+    __u32 off = sizeof(*eth);
+
+    memset(buf, 0, off);
+    memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+    memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+
+    if (bc->ipv6) {
+        struct ipv6hdr *ip6 = (struct ipv6hdr *)(buf + off);
+
+        memset(ip6, 0, sizeof(*ip6));
+        eth->h_proto = htons(ETH_P_IPV6);
+        ip6->version = 6;
+        ip6->payload_len = htons(l4_len);
+        ip6->nexthdr = bc->proto;
+        ip6->hop_limit = 64;
+        // client addresses out of 2001:db8::/32
+        ip6->saddr.s6_addr32[0] = htonl(0x20010db8);
+        ip6->saddr.s6_addr32[3] = htonl(flow + 1);
+        if (svc) {
+            memcpy(&ip6->daddr, svc->vip6, sizeof(ip6->daddr));
+        } else {
+            ip6->daddr.s6_addr32[0] = htonl(0x20010db8);
+            ip6->daddr.s6_addr32[3] = htonl(0xffffffff);
+        }
+        off += sizeof(*ip6);
+    } else {
+        struct iphdr *ip = (struct iphdr *)(buf + off);
+
+        memset(ip, 0, sizeof(*ip));
+        eth->h_proto = htons(ETH_P_IP);
+        ip->version = 4;
+        ip->ihl = sizeof(*ip) / 4;
+        ip->tot_len = htons(sizeof(*ip) + l4_len);
+        ip->ttl = 64;
+        ip->protocol = bc->proto;
+        // client addresses out of 10.0.0.0/8
+        ip->saddr = htonl(0x0a000000 | ((flow + 1) & 0xffffff));
+        ip->daddr = svc ? svc->vip : htonl(0xc0000201); // 192.0.2.1
+        ip->check = bench_ipv4_csum(ip);
+        off += sizeof(*ip);
+    }
+
+    memset(buf + off, 0, l4_len);
+    if (bc->proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = (struct tcphdr *)(buf + off);
+
+        tcp->source = htons(BENCH_SRC_PORT);
+        tcp->dest = dst_port;
+        tcp->doff = sizeof(*tcp) / 4;
+        tcp->syn = syn;
+        tcp->ack = !syn;
+    } else {
+        struct udphdr *udp = (struct udphdr *)(buf + off);
+
+        udp->source = htons(BENCH_SRC_PORT);
+        udp->dest = dst_port;
+        udp->len = htons(l4_len);
+    }
+
+    return off + l4_len;
+}
+
+/* Run the program once on the packet and return the time it took in ns. Every
+ * run gets a fresh copy of the packet, repeating the same buffer would feed the
+ * already encapsulated packet back into the program.
+ */
+static int bench_prog_run(int prog_fd, void *pkt, __u32 len, __u32 *duration, __u32 *retval) {
+    LIBBPF_OPTS(bpf_test_run_opts, topts, .data_in = pkt, .data_size_in = len, .repeat = 1);
+    int err;
+
+    err = bpf_prog_test_run_opts(prog_fd, &topts);
+    if (err)
+        return err;
+
+    *duration = topts.duration;
+    *retval = topts.retval;
+    return 0;
+}
+
+/* Time `prog` takes on top of l4_lb_bench_nop, which just passes the packet.
+ * Neither program changes the packet's size, so the kernel can repeat the run
+ * itself.
+ */
+static int bench_overhead(struct l4_lb_bpf *skel, const struct bench_opts *opts, const char *name,
+                          struct bpf_program *prog) {
+    const struct bench_case bc = {name, 0, IPPROTO_UDP, 0, 1};
+    struct bpf_program *progs[] = {skel->progs.l4_lb_bench_nop, prog};
+    int nop_fd = bpf_program__fd(skel->progs.l4_lb_bench_nop);
+    __u32 stage = LB_STAGE_BENCH;
+    double ns[2];
+    __u8 pkt[256];
+    __u32 len = bench_build_packet(pkt, &bc, NULL, 0, 0);
+
+    // l4_lb_bench_tail_call jumps to l4_lb_bench_nop through this slot
+    if (bpf_map_update_elem(bpf_map__fd(skel->maps.lb_stages), &stage, &nop_fd, BPF_ANY)) {
+        log_error("Failed to install l4_lb_bench_nop as stage %u: %s", stage, strerror(errno));
+        return -1;
+    }
+
+    for (int p = 0; p < 2; p++) {
+        LIBBPF_OPTS(bpf_test_run_opts, topts, .data_in = pkt, .data_size_in = len,
+                    .repeat = opts->iterations);
+
+        if (bpf_prog_test_run_opts(bpf_program__fd(progs[p]), &topts)) {
+            log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+            return -1;
+        }
+        if (topts.retval != XDP_PASS) {
+            log_error("%s returned %s instead of passing the packet",
+                      bpf_program__name(progs[p]), xdp_action_str(topts.retval));
+            return -1;
+        }
+        ns[p] = topts.duration;
+    }
+
+    printf("%-18s %12.1f  (%.1f with, %.1f without)\n", bc.name, ns[1] - ns[0], ns[1], ns[0]);
+    return 0;
+}
+
+struct bench_insert_thread {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    int prog_fd;
+    int cpu;
+    int iterations;
+    __u32 retval;
+    int err;
+};
+
+static void *bench_insert_thread(void *arg) {
+    struct bench_insert_thread *t = arg;
+    const struct bench_case bc = {"insert", 0, IPPROTO_UDP, 0, 1};
+    __u8 pkt[256];
+    __u32 len = bench_build_packet(pkt, &bc, NULL, 0, 0);
+    LIBBPF_OPTS(bpf_test_run_opts, topts, .data_in = pkt, .data_size_in = len,
+                .repeat = t->iterations);
+    cpu_set_t cpus;
+
+    // the kernel runs the program on the CPU of the calling thread
+    CPU_ZERO(&cpus);
+    CPU_SET(t->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    pthread_barrier_wait(t->start);
+    t->err = bpf_prog_test_run_opts(t->prog_fd, &topts) ? -errno : 0;
+    t->retval = topts.retval;
+    return NULL;
+}
+
+/* Run `prog`, which inserts a new flow per run, on `threads` CPUs at once and
+ * return the inserts per second of all of them together, or a negative value.
+ */
+static double bench_insert_rate(struct bpf_program *prog, int threads, int iterations) {
+    struct bench_insert_thread t[threads];
+    pthread_barrier_t start;
+    struct timespec begin, end;
+    double rate = 0;
+    int started = 0;
+
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (; started < threads; started++) {
+        t[started] = (struct bench_insert_thread){
+            .start = &start,
+            .prog_fd = bpf_program__fd(prog),
+            .cpu = started,
+            .iterations = iterations,
+        };
+        if (pthread_create(&t[started].thread, NULL, bench_insert_thread, &t[started]))
+            break;
+    }
+
+    if (started < threads) {
+        // the threads that did start are stuck at the barrier, they can't be joined
+        log_error("Failed to start benchmark thread %d", started);
+        return -1;
+    }
+
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i].thread, NULL);
+        if (t[i].err || t[i].retval != XDP_PASS) {
+            log_error("%s failed on CPU %d: %s", bpf_program__name(prog), t[i].cpu,
+                      t[i].err ? strerror(-t[i].err) : xdp_action_str(t[i].retval));
+            rate = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&start);
+
+    if (rate < 0)
+        return rate;
+
+    double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return (double)threads * iterations / secs;
+}
+
+/* New flow inserts per second into one connection table against the sharded
+ * one, with more and more CPUs inserting at the same time
+ */
+static int bench_conntrack_scaling(struct l4_lb_bpf *skel, const struct bench_opts *opts) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("\n%-18s %12s  %12s\n", "conntrack inserts", "single M/s", "sharded M/s");
+    for (long threads = 1;; threads = threads * 2 < cpus ? threads * 2 : cpus) {
+        double single = bench_insert_rate(skel->progs.l4_lb_bench_ct_single, threads,
+                                          opts->iterations);
+        double sharded = bench_insert_rate(skel->progs.l4_lb_bench_ct_sharded, threads,
+                                           opts->iterations);
+        char name[32];
+
+        if (single < 0 || sharded < 0)
+            return -1;
+
+        snprintf(name, sizeof(name), "%ld CPUs", threads);
+        printf("%-18s %12.2f  %12.2f\n", name, single / 1e6, sharded / 1e6);
+        if (threads == cpus)
+            break;
+    }
+
+    return 0;
+}
+
+int bench_run(struct l4_lb_bpf *skel, const struct bench_opts *opts) {
+    int prog_fd = bpf_program__fd(skel->progs.l4_lb);
+    __u8 pkt[256];
+    __u32 flow_base = 0;
+
+    printf("%-18s %12s  %s\n", "case", "ns/packet", "action");
+
+    for (int c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+        const struct bench_case *bc = &bench_cases[c];
+        __u64 total_ns = 0;
+        __u32 duration, retval = 0;
+        const struct service_key *svc = NULL;
+
+        if (!bc->no_vip) {
+            svc = bench_find_service(bc, opts);
+            if (!svc)
+                continue;
+        }
+
+        if (!bc->new_flows && svc) {
+            // open the flow first so that the measured packets hit the conntrack entry
+            __u32 len = bench_build_packet(pkt, bc, svc, flow_base, 1);
+            if (bench_prog_run(prog_fd, pkt, len, &duration, &retval)) {
+                log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+                return -1;
+            }
+        }
+
+        for (int i = 0; i < opts->iterations; i++) {
+            __u32 flow = bc->new_flows ? flow_base + 1 + i : flow_base;
+            __u32 len = bench_build_packet(pkt, bc, svc, flow, bc->new_flows);
+
+            if (bench_prog_run(prog_fd, pkt, len, &duration, &retval)) {
+                log_error("BPF_PROG_TEST_RUN failed: %s", strerror(errno));
+                return -1;
+            }
+            total_ns += duration;
+        }
+
+        // never reuse the flows of an earlier case
+        flow_base += opts->iterations + 1;
+
+        printf("%-18s %12.1f  %s\n", bc->name, (double)total_ns / opts->iterations,
+               xdp_action_str(retval));
+    }
+
+    // a tail call between the stages, and the software flow hash the NIC's RSS hash replaces
+    if (bench_overhead(skel, opts, "tail call", skel->progs.l4_lb_bench_tail_call) ||
+        bench_overhead(skel, opts, "flow hash", skel->progs.l4_lb_bench_flow_hash))
+        return -1;
+
+    return bench_conntrack_scaling(skel, opts);
+}
+
+void bench_skip_programs(struct l4_lb_bpf *skel) {
+    const char *prefix = "l4_lb_bench_";
+    struct bpf_program *prog;
+
+    bpf_object__for_each_program(prog, skel->obj) {
+        if (strncmp(bpf_program__name(prog), prefix, strlen(prefix)) == 0)
+            bpf_program__set_autoload(prog, false);
+    }
+}
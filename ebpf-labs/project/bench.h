@@ -0,0 +1,28 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "ebpf/l4_lb_common.h"
+#include "l4_lb.skel.h"
+
+struct bench_opts {
+    int iterations; /* packets per benchmark case */
+    const struct service_key *services;
+    int services_count;
+};
+
+/* Measure the ns per packet of the loaded (not attached) l4_lb program for
+ * known and new UDP/TCP flows through BPF_PROG_TEST_RUN and print the results.
+ * Every case is sent to the first configured service of its family and
+ * protocol and skipped if there is none. The cost of a single tail call between
+ * the stages of the pipeline and of hashing a flow in software come next, and
+ * last the rate of new flow inserts into a single and the sharded connection
+ * table as the number of CPUs grows.
+ */
+int bench_run(struct l4_lb_bpf *skel, const struct bench_opts *opts);
+
+/* Keep the l4_lb_bench_* programs out of a load that won't run the benchmark,
+ * so that they are neither verified nor loaded into the kernel.
+ */
+void bench_skip_programs(struct l4_lb_bpf *skel);
+
+#endif // BENCH_H_
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conntrack.h"
+#include "log.h"
+
+/* Flows read or written per syscall while a shard is copied */
+#define COPY_BATCH 4096
+
+static __u32 shard_flows(__u32 max_flows) {
+    __u32 flows = (max_flows + CONNTRACK_SHARDS - 1) / CONNTRACK_SHARDS;
+
+    return flows > 0 ? flows : 1;
+}
+
+static int shard_create(__u32 flows) {
+    int fd = bpf_map_create(BPF_MAP_TYPE_LRU_HASH, "conntrack_shard", sizeof(struct connection),
+                            sizeof(struct flow_state), flows, NULL);
+
+    return fd < 0 ? -errno : fd;
+}
+
+/* Read up to `max` flows of a shard, COPY_BATCH per syscall */
+static int shard_read(int fd, struct connection *keys, struct flow_state *flows, __u32 max,
+                      __u32 *count) {
+    void *in_batch = NULL;
+    __u32 token;
+
+    *count = 0;
+    while (*count < max) {
+        __u32 n = max - *count < COPY_BATCH ? max - *count : COPY_BATCH;
+        int err = bpf_map_lookup_batch(fd, in_batch, &token, keys + *count, flows + *count, &n,
+                                       NULL);
+
+        *count += n;
+        // the end of the shard is reported together with the last flows
+        if (err)
+            return errno == ENOENT ? 0 : -errno;
+        in_batch = &token;
+    }
+
+    return 0;
+}
+
+/* Add flows to a shard, COPY_BATCH per syscall, and count the ones added. A
+ * flow the data plane already added to the shard is kept as it is.
+ */
+static int shard_write(int fd, const struct connection *keys, const struct flow_state *flows,
+                       __u32 count, __u32 *copied) {
+    LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = BPF_NOEXIST);
+
+    for (__u32 done = 0; done < count;) {
+        __u32 n = count - done < COPY_BATCH ? count - done : COPY_BATCH;
+        int err = bpf_map_update_batch(fd, keys + done, flows + done, &n, &opts);
+        int saved_errno = errno;
+
+        done += n;
+        *copied += n;
+        if (err && saved_errno != EEXIST)
+            return -saved_errno;
+        // the batch stops at a flow that exists, go on after it
+        if (err)
+            done++;
+    }
+
+    return 0;
+}
+
+static int flow_more_recent(const void *a, const void *b) {
+    const struct flow_state *fa = a, *fb = b;
+
+    return fa->last_seen < fb->last_seen ? 1 : fa->last_seen > fb->last_seen ? -1 : 0;
+}
+
+/* Take over the shard a previous run left in a reused connections_map, in the
+ * size asked for. Returns 1 if there was one, 0 if there is none.
+ */
+static int shard_adopt(struct conntrack *ct, __u32 shard) {
+    int outer_fd = bpf_map__fd(ct->skel->maps.connections_map);
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+    __u32 id;
+    int fd;
+
+    // user space reads the ID of an inner map, not its fd
+    if (bpf_map_lookup_elem(outer_fd, &shard, &id))
+        return 0;
+
+    fd = bpf_map_get_fd_by_id(id);
+    if (fd < 0)
+        return 0;
+
+    ct->shard_fds[shard] = fd;
+    if (bpf_obj_get_info_by_fd(fd, &info, &len) == 0 && info.max_entries == ct->shard_flows)
+        return 1;
+
+    int err = conntrack_resize_shard(ct, shard, ct->shard_flows);
+    return err ? err : 1;
+}
+
+int conntrack_init(struct conntrack *ct, struct l4_lb_bpf *skel, __u32 max_flows) {
+    int outer_fd = bpf_map__fd(skel->maps.connections_map);
+    int adopted = 0;
+
+    memset(ct, 0, sizeof(*ct));
+    ct->skel = skel;
+    ct->shard_flows = shard_flows(max_flows);
+    for (__u32 i = 0; i < CONNTRACK_SHARDS; i++)
+        ct->shard_fds[i] = -1;
+
+    for (__u32 i = 0; i < CONNTRACK_SHARDS; i++) {
+        int ret = shard_adopt(ct, i);
+
+        if (ret > 0) {
+            adopted++;
+            continue;
+        }
+
+        int fd = ret < 0 ? ret : shard_create(ct->shard_flows);
+        if (fd < 0) {
+            log_error("Failed to create conntrack shard %u: %s", i, strerror(-fd));
+            conntrack_free(ct);
+            return fd;
+        }
+
+        ct->shard_fds[i] = fd;
+        if (bpf_map_update_elem(outer_fd, &i, &fd, BPF_ANY)) {
+            int err = -errno;
+
+            log_error("Failed to install conntrack shard %u: %s", i, strerror(errno));
+            conntrack_free(ct);
+            return err;
+        }
+    }
+
+    log_info("Conntrack table of %u shards with %u flows each, %d shards kept from the last run",
+             CONNTRACK_SHARDS, ct->shard_flows, adopted);
+    return 0;
+}
+
+void conntrack_free(struct conntrack *ct) {
+    for (__u32 i = 0; i < CONNTRACK_SHARDS; i++) {
+        if (ct->shard_fds[i] >= 0)
+            close(ct->shard_fds[i]);
+        ct->shard_fds[i] = -1;
+    }
+}
+
+int conntrack_resize_shard(struct conntrack *ct, __u32 shard, __u32 flows) {
+    int outer_fd = bpf_map__fd(ct->skel->maps.connections_map);
+    int old_fd = ct->shard_fds[shard];
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+    __u32 count = 0, copied = 0;
+    int err;
+
+    if (bpf_obj_get_info_by_fd(old_fd, &info, &len))
+        return -errno;
+
+    // a flow and its key, in the order the flows are sorted in
+    struct {
+        struct flow_state flow;
+        struct connection key;
+    } *entries = NULL;
+    struct connection *keys = calloc(info.max_entries, sizeof(*keys));
+    struct flow_state *values = calloc(info.max_entries, sizeof(*values));
+    int fd = shard_create(flows);
+
+    if (fd < 0 || !keys || !values) {
+        err = fd < 0 ? fd : -ENOMEM;
+        goto out;
+    }
+
+    /* From here on the data plane adds and refreshes its flows in the new
+     * shard. Replacing an inner map waits for the programs still using the old
+     * one, so the old shard doesn't change any more while it is copied.
+     */
+    if (bpf_map_update_elem(outer_fd, &shard, &fd, BPF_EXIST)) {
+        err = -errno;
+        close(fd);
+        goto out;
+    }
+    ct->shard_fds[shard] = fd;
+
+    err = shard_read(old_fd, keys, values, info.max_entries, &count);
+    if (err)
+        goto out_old;
+
+    // if the flows don't all fit, keep the most recently seen ones
+    if (count > flows) {
+        entries = calloc(count, sizeof(*entries));
+        if (!entries) {
+            err = -ENOMEM;
+            goto out_old;
+        }
+        for (__u32 i = 0; i < count; i++) {
+            entries[i].flow = values[i];
+            entries[i].key = keys[i];
+        }
+        qsort(entries, count, sizeof(*entries), flow_more_recent);
+        count = flows;
+        for (__u32 i = 0; i < count; i++) {
+            values[i] = entries[i].flow;
+            keys[i] = entries[i].key;
+        }
+    }
+
+    err = shard_write(fd, keys, values, count, &copied);
+    log_debug("Conntrack shard %u resized to %u flows, %u flows copied", shard, flows, copied);
+
+out_old:
+    close(old_fd);
+out:
+    free(entries);
+    free(keys);
+    free(values);
+    return err;
+}
+
+int conntrack_resize(struct conntrack *ct, __u32 max_flows) {
+    __u32 flows = shard_flows(max_flows);
+
+    if (flows == ct->shard_flows)
+        return 0;
+
+    log_info("Resizing the conntrack shards from %u to %u flows", ct->shard_flows, flows);
+
+    // one shard at a time, so only the flows of one shard are in flux at once
+    for (__u32 i = 0; i < CONNTRACK_SHARDS; i++) {
+        int err = conntrack_resize_shard(ct, i, flows);
+
+        if (err) {
+            log_error("Failed to resize conntrack shard %u: %s", i, strerror(-err));
+            return err;
+        }
+    }
+
+    ct->shard_flows = flows;
+    return 0;
+}
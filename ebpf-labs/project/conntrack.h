@@ -0,0 +1,38 @@
+#ifndef CONNTRACK_H_
+#define CONNTRACK_H_
+
+#include "ebpf/l4_lb_common.h"
+#include "l4_lb.skel.h"
+
+/* The shards of the connection table, created by the control plane and put
+ * into the connections_map array of maps.
+ */
+struct conntrack {
+    struct l4_lb_bpf *skel;
+    int shard_fds[CONNTRACK_SHARDS];
+    __u32 shard_flows; /* size of every shard */
+};
+
+/* Create the shards for `max_flows` flows in total and install them. The
+ * program has to be loaded.
+ */
+int conntrack_init(struct conntrack *ct, struct l4_lb_bpf *skel, __u32 max_flows);
+void conntrack_free(struct conntrack *ct);
+
+/* Replace a shard with a map of `flows` entries holding the same flows. The
+ * new shard is installed first and the flows of the old one are copied over in
+ * batches, the most recently seen ones if they don't all fit. A flow that sees
+ * a packet before it is copied is handled as a flow without state: a TCP
+ * packet goes to the Maglev backend, which under least_conn is usually not the
+ * flow's own, and a UDP flow is pinned anew and keeps that backend.
+ */
+int conntrack_resize_shard(struct conntrack *ct, __u32 shard, __u32 flows);
+
+/* Resize all shards so that they hold `max_flows` flows in total */
+int conntrack_resize(struct conntrack *ct, __u32 max_flows);
+
+static inline __u32 conntrack_max_flows(const struct conntrack *ct) {
+    return ct->shard_flows * CONNTRACK_SHARDS;
+}
+
+#endif // CONNTRACK_H_
@@ -82,12 +82,44 @@ set +x
 # Create two network namespaces and veth pairs
 create_veth ${num_ips}
 
-vip=$(echo "$yaml" | shyaml get-value vip)
+# Collect the distinct VIPs of the services, several services can share one
+num_services=$(echo "$yaml" | shyaml get-length services)
+vips=()
+vips6=()
+for (( i=0; i<$num_services; i++ )); do
+    svc_vip=$(echo "$yaml" | shyaml get-value services.$i.vip)
+    if [[ "$svc_vip" == *:* ]]; then
+      [[ " ${vips6[*]} " == *" ${svc_vip} "* ]] || vips6+=("$svc_vip")
+    else
+      [[ " ${vips[*]} " == *" ${svc_vip} "* ]] || vips+=("$svc_vip")
+    fi
+done
+
+# The first VIP of each family sets up the link to the host, the others are
+# added as host addresses and routed through it
+vip=${vips[0]}
 IFS='.' read -r octet1 octet2 octet3 octet4 <<< "$vip"
 vip_gateway="$octet1.$octet2.$octet3.0"
 sudo ip netns exec ns1 ifconfig veth1_ ${vip}/24
 sudo ifconfig veth1 ${vip_gateway}/24 up
 sudo sysctl net.ipv4.conf.veth1.rp_filter=0
+for extra_vip in "${vips[@]:1}"; do
+  sudo ip netns exec ns1 ip addr add ${extra_vip}/32 dev veth1_
+  sudo ip route add ${extra_vip}/32 via ${vip}
+done
+
+# IPv6 VIPs are optional, the host side of a /64 gets the ::fe address of the prefix
+vip6=${vips6[0]:-}
+if [ ! -z "$vip6" ]; then
+  sudo sysctl net.ipv6.conf.all.forwarding=1
+  vip6_gateway="${vip6%::*}::fe"
+  sudo ip netns exec ns1 ip -6 addr add ${vip6}/64 dev veth1_
+  sudo ip -6 addr add ${vip6_gateway}/64 dev veth1
+  for extra_vip in "${vips6[@]:1}"; do
+    sudo ip netns exec ns1 ip -6 addr add ${extra_vip}/128 dev veth1_
+    sudo ip -6 route add ${extra_vip}/128 via ${vip6}
+  done
+fi
 
 # Loop through the ips in the YAML file
 for (( i=0; i<$num_ips-1; i++ )); do
@@ -98,6 +130,23 @@ for (( i=0; i<$num_ips-1; i++ )); do
 
     echo -e "${COLOR_GREEN} IP: $ip"
 
+    if [[ "$ip" == *:* ]]; then
+      gateway="${ip%::*}::fe"
+      sudo ip netns exec ns${port} ip -6 addr add ${ip}/64 dev veth${port}_
+      sudo ip -6 addr add ${gateway}/64 dev veth${port}
+
+      if [ ! -z "$vip6" ]; then
+        sudo ip netns exec ns1 ip -6 route add ${ip}/128 via ${vip6_gateway}
+        # l4_decap delivers the packets to the VIPs locally, replies go straight to the client
+        sudo ip netns exec ns${port} ip link set lo up
+        for svc_vip in "${vips6[@]}"; do
+          sudo ip netns exec ns${port} ip -6 addr add ${svc_vip}/128 dev lo
+        done
+        sudo ip netns exec ns${port} ip -6 route add default via ${gateway}
+      fi
+      continue
+    fi
+
     sudo ip netns exec ns${port} ifconfig veth${port}_ ${ip}/24
     # sudo ifconfig veth${port} ${gw}/24
     
@@ -106,7 +155,16 @@ for (( i=0; i<$num_ips-1; i++ )); do
     sudo ifconfig veth${port} ${gateway}/24 up
     
     sudo ip netns exec ns1 ip route add ${ip}/32 via ${vip_gateway}
-    sudo ip netns exec ns${port} ip route add ${vip}/32 via ${gateway}
+
+    # l4_decap delivers the packets to the VIPs locally, replies go straight to the
+    # client. The backend must not answer ARP requests for the VIPs.
+    sudo ip netns exec ns${port} ip link set lo up
+    sudo ip netns exec ns${port} sysctl -q net.ipv4.conf.all.arp_ignore=1
+    sudo ip netns exec ns${port} sysctl -q net.ipv4.conf.all.arp_announce=2
+    for svc_vip in "${vips[@]}"; do
+      sudo ip netns exec ns${port} ip addr add ${svc_vip}/32 dev lo
+    done
+    sudo ip netns exec ns${port} ip route add default via ${gateway}
 
 
     sudo sysctl net.ipv4.conf.veth${port}.rp_filter=0
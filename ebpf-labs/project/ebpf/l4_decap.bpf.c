@@ -0,0 +1,164 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "l4_decap_common.h"
+
+/* Longest tunnel header between the outer and the inner IP header (GUE) */
+#define MAX_TUNNEL_LEN (sizeof(struct udphdr) + sizeof(struct guehdr))
+
+const volatile struct {
+    __u8 encap;        /* enum lb_encap the load balancer uses */
+    __be16 encap_port; /* destination port of FOU and GUE */
+} l4_decap_cfg = {};
+
+/* The VIPs served by this backend. Tunneled packets for other addresses are
+ * left to the stack, so the program can't be used to inject arbitrary traffic.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct decap_vip);
+    __type(value, __u8);
+    __uint(max_entries, DECAP_MAX_VIPS);
+} vips SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, DECAP_STAT_MAX);
+} decap_stats SEC(".maps");
+
+static __always_inline void decap_stat_inc(__u32 stat) {
+    __u64 *cnt = bpf_map_lookup_elem(&decap_stats, &stat);
+    if (cnt)
+        *cnt += 1;
+}
+
+/* Length of the UDP (and GUE) header in front of the inner packet of the
+ * given protocol, or -1 if the datagram is not one of our tunnels.
+ */
+static __always_inline int decap_udp_len(void *data_end, struct udphdr *udphdr, __u8 inner_proto) {
+    if ((void *)(udphdr + 1) > data_end || udphdr->dest != l4_decap_cfg.encap_port)
+        return -1;
+
+    if (l4_decap_cfg.encap == LB_ENCAP_FOU)
+        return sizeof(*udphdr);
+
+    struct guehdr *guehdr = (void *)(udphdr + 1);
+    if ((void *)(guehdr + 1) > data_end)
+        return -1;
+
+    // l4_lb only sends variant 0 data messages without optional fields
+    if (guehdr->hlen_ver != 0 || guehdr->proto_ctype != inner_proto)
+        return -1;
+
+    return sizeof(*udphdr) + sizeof(*guehdr);
+}
+
+/* Length of the outer IPv4 header and tunnel header in front of the inner
+ * IPv4 packet, or -1 if this is not a tunneled packet.
+ */
+static __always_inline int decap_ipv4_len(void *data_end, struct iphdr *iphdr) {
+    if ((void *)(iphdr + 1) > data_end || iphdr->ihl != sizeof(*iphdr) / 4)
+        return -1;
+
+    if (l4_decap_cfg.encap == LB_ENCAP_IPIP)
+        return iphdr->protocol == IPPROTO_IPIP ? sizeof(*iphdr) : -1;
+
+    if (iphdr->protocol != IPPROTO_UDP)
+        return -1;
+
+    int udp_len = decap_udp_len(data_end, (void *)(iphdr + 1), IPPROTO_IPIP);
+    return udp_len < 0 ? -1 : sizeof(*iphdr) + udp_len;
+}
+
+static __always_inline int decap_ipv6_len(void *data_end, struct ipv6hdr *ip6hdr) {
+    if ((void *)(ip6hdr + 1) > data_end)
+        return -1;
+
+    if (l4_decap_cfg.encap == LB_ENCAP_IPIP)
+        return ip6hdr->nexthdr == IPPROTO_IPV6 ? sizeof(*ip6hdr) : -1;
+
+    if (ip6hdr->nexthdr != IPPROTO_UDP)
+        return -1;
+
+    int udp_len = decap_udp_len(data_end, (void *)(ip6hdr + 1), IPPROTO_IPV6);
+    return udp_len < 0 ? -1 : sizeof(*ip6hdr) + udp_len;
+}
+
+/* Strip the tunnel l4_lb put around the packet and hand the inner packet,
+ * still addressed to the VIP, to the stack. The backend has the VIP on a local
+ * interface, so it answers the client directly from the VIP (direct server
+ * return) and the replies never go through the load balancer.
+ */
+SEC("xdp")
+int l4_decap(struct xdp_md *ctx) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct ethhdr *eth = data;
+    struct decap_vip vip = {};
+    int outer_len;
+
+    if ((void *)(eth + 1) > data_end)
+        return XDP_PASS;
+
+    if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+        outer_len = decap_ipv4_len(data_end, (void *)(eth + 1));
+        if (outer_len < 0 || outer_len > sizeof(struct iphdr) + MAX_TUNNEL_LEN)
+            return XDP_PASS;
+
+        struct iphdr *inner = (void *)(eth + 1) + outer_len;
+        if ((void *)(inner + 1) > data_end)
+            return XDP_PASS;
+
+        vip.vip = inner->daddr;
+    } else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+        outer_len = decap_ipv6_len(data_end, (void *)(eth + 1));
+        if (outer_len < 0 || outer_len > sizeof(struct ipv6hdr) + MAX_TUNNEL_LEN)
+            return XDP_PASS;
+
+        struct ipv6hdr *inner = (void *)(eth + 1) + outer_len;
+        if ((void *)(inner + 1) > data_end)
+            return XDP_PASS;
+
+        memcpy(vip.vip6, &inner->daddr, sizeof(vip.vip6));
+        vip.ipv6 = 1;
+    } else {
+        return XDP_PASS;
+    }
+
+    if (!bpf_map_lookup_elem(&vips, &vip)) {
+        decap_stat_inc(DECAP_STAT_UNKNOWN_VIP);
+        return XDP_PASS;
+    }
+
+    // the inner packet has the same family as the outer one, only the addresses move
+    struct ethhdr eth_copy = *eth;
+
+    if (bpf_xdp_adjust_head(ctx, outer_len) != 0)
+        return XDP_DROP;
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+    eth = data;
+    if ((void *)(eth + 1) > data_end)
+        return XDP_DROP;
+
+    *eth = eth_copy;
+    decap_stat_inc(DECAP_STAT_PACKETS);
+
+    return XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "Dual BSD/GPL";
@@ -0,0 +1,31 @@
+#ifndef L4_DECAP_COMMON_H_
+#define L4_DECAP_COMMON_H_
+
+/* Types shared between the decapsulation program on the backends and its
+ * loader. The tunnel formats are the ones of l4_lb.
+ */
+
+#include <linux/types.h>
+
+#include "l4_lb_common.h"
+
+#define DECAP_MAX_VIPS MAX_SERVICES
+
+/* Key of the vips map, a VIP the backend serves */
+struct decap_vip {
+    union {
+        __be32 vip;
+        __be32 vip6[4];
+    };
+    __u8 ipv6;
+    __u8 pad[3];
+};
+
+/* Index into the per-CPU decap_stats array */
+enum decap_stat {
+    DECAP_STAT_PACKETS,     /* a packet was decapsulated and passed to the stack */
+    DECAP_STAT_UNKNOWN_VIP, /* a tunneled packet was not addressed to one of our VIPs */
+    DECAP_STAT_MAX,
+};
+
+#endif // L4_DECAP_COMMON_H_
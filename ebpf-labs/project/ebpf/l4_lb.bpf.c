@@ -16,48 +16,326 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "jhash.h"
+#include "l4_lb_common.h"
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
+/* How long a resolved next hop is used before asking the FIB again */
+#define NEXTHOP_CACHE_TTL_NS 1000000000ULL
+/* How long a failed lookup is remembered, so that it isn't repeated per packet */
+#define NEXTHOP_FAIL_TTL_NS 100000000ULL
+
+/* Fragments of the same datagram that can be in flight at once */
+#define FRAG_MAX_ENTRIES 8192
+
+#define IP_DF 0x4000
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1fff
+
+/* The ICMP errors quote the IP header and the first 8 bytes of the packet */
+#define ICMP_QUOTE_LEN (sizeof(struct iphdr) + 8)
+#define ICMP6_QUOTE_LEN (sizeof(struct ipv6hdr) + 8)
+#define IPV6_MIN_MTU 1280
+
+/* Clients that answered a SYN cookie challenge and for how long they are trusted */
+#define SYN_VERIFIED_MAX_ENTRIES 65536
+#define SYN_VERIFIED_TTL_NS (300 * 1000000000ULL)
+#define SYN_COOKIE_WINDOW 65535
+
+/* Other backends a new flow tries when the selected one is at its cap */
+#define CAP_RETRIES 2
+
+/* Clients of all services whose token bucket is tracked at once */
+#define RATELIMIT_MAX_ENTRIES 65536
+
+/* Size of the flow event ring buffer. The control plane is only woken up
+ * once a part of it is filled, otherwise it reads the events every second.
+ */
+#define FLOW_EVENTS_SIZE (1 << 20)
+#define FLOW_EVENTS_WAKEUP_BYTES (FLOW_EVENTS_SIZE / 8)
+
+/* From include/net/xdp.h, which is not part of the UAPI */
+enum xdp_rss_hash_type {
+    XDP_RSS_L4 = 1 << 3, /* the hash covers the ports */
+};
+
+/* Hash the NIC computed for RSS, only available to programs bound to a device */
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+                                    enum xdp_rss_hash_type *rss_type) __ksym __weak;
+
+/* Returned by the stages to continue with the next one */
+#define LB_NEXT_SELECT -1
+#define LB_NEXT_ENCAP -2
+
 const volatile struct {
-    __u8 backend_count;
-    struct in_addr vip;
+    /* l4_lb_rx_hash runs all stages without tail calls, so it takes the policy
+     * and the encapsulation from here instead of from lb_stages
+     */
+    __u8 policy;
+    __u8 encap;
+    __u64 flow_idle_timeout_ns;
+    __u64 flow_closing_timeout_ns;
 } l4_lb_cfg = {};
 
-/* This is the data record stored in the map */
-struct backend {
-    __be32 ip;
-    __u64 num_flows;
-    __u64 num_packets;
+/* Settings the control plane may change while the program runs */
+struct {
+    __be16 encap_port;     /* destination port of FOU and GUE */
+    __u16 mtu;             /* largest encapsulated IP packet towards the backends, 0 for no limit */
+    __u8 syn_cookies;      /* challenge the SYNs of unverified clients */
+    __u32 flow_log_sample; /* log the events of 1 in this many flows, 0 for none */
+} l4_lb_runtime = {};
+
+/* Parse results handed from one stage of the pipeline to the next, stored in
+ * the XDP metadata in front of the packet. The kernel allows 32 bytes at most,
+ * so the flow key itself is read from the packet again at the offsets found.
+ */
+struct lb_meta {
+    __u64 now;         /* bpf_ktime_get_ns() when the backend was selected */
+    __u32 hash;        /* packet_hash() of the packet */
+    __u32 ring;        /* Maglev ring of the service, including the ring copy */
+    __u32 backend_idx; /* set by the select stage */
+    __u16 l4_off;
+    __u8 proto;
+    __u8 flags; /* LB_META_* */
+};
+
+#define LB_META_IPV6 (1 << 0)
+#define LB_META_TCP_SYN (1 << 1)
+#define LB_META_TCP_FIN (1 << 2)
+#define LB_META_TCP_RST (1 << 3)
+#define LB_META_FRAG (1 << 4) /* first fragment of an IPv4 datagram */
+
+/* Identifies the fragments of one IPv4 datagram */
+struct frag_key {
+    __be32 src_addr;
+    __be32 dst_addr;
+    __be16 id;
+    __u8 proto;
+    __u8 pad;
+};
+
+/* Where the first fragment of a datagram went */
+struct frag_state {
+    __u32 backend_idx;
+    __u32 hash;      /* flow hash of the first fragment, keeps the outer UDP source port */
+    __be16 dst_port; /* finds the service again for the rate limit */
+    __u16 pad;
 };
 
+/* Largest offset of the L4 header, behind an IPv4 header with all options */
+#define MAX_L4_OFF (sizeof(struct ethhdr) + 60)
+
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
     __type(key, __u32);
     __type(value, struct backend);
-    __uint(max_entries, 1024);
+    __uint(max_entries, MAX_BACKENDS);
 } backend_map SEC(".maps");
 
-struct connection {
-    __be32 dst_addr;
-    __be32 src_addr;
-    __be16 dst_port;
-    __be16 src_port;
+/* Per-CPU packet and flow counters of the backends, so that the data plane
+ * never writes to a cache line shared with other cores.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct backend_stats);
+    __uint(max_entries, MAX_BACKENDS);
+} backend_stats SEC(".maps");
+
+/* Next hop towards every backend, resolved by the data plane on demand */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct nexthop);
+    __uint(max_entries, MAX_BACKENDS);
+} nexthop_cache SEC(".maps");
+
+/* Interfaces packets can be redirected to, keyed by ifindex */
+struct {
+    __uint(type, BPF_MAP_TYPE_DEVMAP_HASH);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 64);
+} tx_ports SEC(".maps");
+
+/* Client addresses that proved to receive our packets, with the time they did */
+struct client_key {
+    __be32 addr[4]; /* IPv4 addresses only use the first word */
+    __u8 ipv6;
+    __u8 pad[3];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct client_key);
+    __type(value, __u64);
+    __uint(max_entries, SYN_VERIFIED_MAX_ENTRIES);
+} syn_verified SEC(".maps");
+
+/* Token bucket of a client of a service */
+struct ratelimit_key {
+    __be32 addr[4]; /* IPv4 addresses only use the first word */
+    __u32 service;  /* slot of the service, as in service.ring */
+    __u8 ipv6;
+    __u8 pad[3];
 };
 
+/* The bucket is kept as the time at which it is full again. Every packet takes
+ * a token and so pushes that time by the interval between two tokens, a bucket
+ * whose full time is a whole burst ahead is empty.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct ratelimit_key);
+    __type(value, __u64);
+    __uint(max_entries, RATELIMIT_MAX_ENTRIES);
+} ratelimit_map SEC(".maps");
+
+/* Per-CPU count of the packets each service dropped over the rate limit */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, MAX_SERVICES);
+} ratelimit_drops SEC(".maps");
+
+/* Stages of the pipeline, filled in by the control plane. Replacing an entry
+ * swaps a stage without touching the others.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(key_size, sizeof(__u32));
+    __uint(value_size, sizeof(__u32));
+    __uint(max_entries, LB_STAGE_MAX);
+} lb_stages SEC(".maps");
+
+/* Backends of fragmented datagrams. Only the first fragment has the ports, so it
+ * records its backend here and the others, which carry no L4 header, follow it.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct frag_key);
+    __type(value, struct frag_state);
+    __uint(max_entries, FRAG_MAX_ENTRIES);
+} frag_map SEC(".maps");
+
+/* The services to balance, all other traffic is passed to the stack */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct service_key);
+    __type(value, struct service);
+    __uint(max_entries, MAX_SERVICES);
+} services_map SEC(".maps");
+
+/* Maglev lookup tables, map a flow hash to the index of a backend. There is
+ * one ring per service, built by the control plane whenever the backends of the
+ * service change. The real size is set from the number of services before loading.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, MAGLEV_TABLE_SIZE);
+} maglev_map SEC(".maps");
+
+/* A shard of the connection tracking table. The least recently used flows of
+ * the shard are evicted once it is full.
+ */
+struct conntrack_shard {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __type(key, struct connection);
-    __type(value, int);
-    __uint(max_entries, 1024);
+    __type(value, struct flow_state);
+    __uint(max_entries, DEFAULT_CONNTRACK_MAX_FLOWS / CONNTRACK_SHARDS);
+};
+
+/* Connection tracking table. The control plane creates the shards with their
+ * size from the config and may replace one with a bigger or smaller copy.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __type(key, __u32);
+    __uint(max_entries, CONNTRACK_SHARDS);
+    __array(values, struct conntrack_shard);
 } connections_map SEC(".maps");
 
-__attribute__((__always_inline__)) static inline void ipv4_csum(struct iphdr *iph) {
-    uint16_t *next = (uint16_t *)iph;
-    uint32_t csum = 0;
-    iph->check = 0;
-    for (int i = 0; i < sizeof(struct iphdr) >> 1; i++) {
-        csum += *next;
-        next++;
+/* Unsharded table the conntrack benchmark compares the shards to, only sized
+ * when benchmarking
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct connection);
+    __type(value, struct flow_state);
+    __uint(max_entries, DEFAULT_CONNTRACK_MAX_FLOWS);
+} bench_conntrack SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, LB_STAT_MAX);
+} lb_stats SEC(".maps");
+
+static __always_inline void lb_stat_inc(__u32 stat) {
+    __u64 *cnt = bpf_map_lookup_elem(&lb_stats, &stat);
+    if (cnt)
+        *cnt += 1;
+}
+
+/* Sampled new-flow and flow-end events for the flow log of the control plane */
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, FLOW_EVENTS_SIZE);
+} flow_events SEC(".maps");
+
+/* Sample by the flow hash, so that the end of a flow is logged if its start was */
+static __always_inline __u8 flow_sampled(__u32 hash) {
+    __u32 sample = l4_lb_runtime.flow_log_sample;
+
+    return sample && hash % sample == 0;
+}
+
+static __always_inline void emit_flow_event(const struct connection *conn, __u32 backend_idx,
+                                       __u8 type, __u64 now) {
+    struct flow_event *ev = bpf_ringbuf_reserve(&flow_events, sizeof(*ev), 0);
+    if (!ev) {
+        lb_stat_inc(LB_STAT_FLOW_EVENTS_LOST);
+        return;
     }
-    iph->check = ~((csum & 0xffff) + (csum >> 16));
+
+    ev->timestamp_ns = now;
+    ev->conn = *conn;
+    ev->backend_idx = backend_idx;
+    ev->type = type;
+    __builtin_memset(ev->pad, 0, sizeof(ev->pad));
+
+    // one wakeup per batch of events instead of one per event
+    __u64 flags = bpf_ringbuf_query(&flow_events, BPF_RB_AVAIL_DATA) >= FLOW_EVENTS_WAKEUP_BYTES
+                      ? BPF_RB_FORCE_WAKEUP
+                      : BPF_RB_NO_WAKEUP;
+    bpf_ringbuf_submit(ev, flags);
+}
+
+static __always_inline __u16 csum_fold(__u32 csum) {
+    csum = (csum & 0xffff) + (csum >> 16);
+    csum = (csum & 0xffff) + (csum >> 16);
+    return ~csum;
+}
+
+/* Decrement the TTL and patch the checksum incrementally (RFC 1624), the same
+ * way the kernel does it in ip_decrease_ttl().
+ */
+static __always_inline void ipv4_decrease_ttl(struct iphdr *iph) {
+    __u32 check = iph->check;
+
+    check += bpf_htons(0x0100);
+    iph->check = (__u16)(check + (check >= 0xffff));
+    iph->ttl -= 1;
 }
 
 static __always_inline int parse_ethhdr(void *data, void *data_end, __u16 *nh_off,
@@ -105,6 +383,20 @@ static __always_inline int parse_iphdr(void *data, void *data_end, __u16 *nh_off
     return ip->protocol;
 }
 
+static __always_inline int parse_ipv6hdr(void *data, void *data_end, __u16 *nh_off,
+                                         struct ipv6hdr **ipv6hdr) {
+    struct ipv6hdr *ip6 = data + *nh_off;
+
+    /* Extension headers are not walked, their packets are passed to the stack */
+    if ((void *)ip6 + sizeof(*ip6) > data_end)
+        return -1;
+
+    *nh_off += sizeof(*ip6);
+    *ipv6hdr = ip6;
+
+    return ip6->nexthdr;
+}
+
 static __always_inline int parse_udphdr(void *data, void *data_end, __u16 *nh_off,
                                         struct udphdr **udphdr) {
     struct udphdr *udp = data + *nh_off;
@@ -123,18 +415,672 @@ static __always_inline int parse_udphdr(void *data, void *data_end, __u16 *nh_of
     return len;
 }
 
-__u64 backend_load(int i) {
+static __always_inline int parse_tcphdr(void *data, void *data_end, __u16 *nh_off,
+                                        struct tcphdr **tcphdr) {
+    struct tcphdr *tcp = data + *nh_off;
+    int hdr_size;
+
+    if ((void *)tcp + sizeof(*tcp) > data_end)
+        return -1;
+
+    hdr_size = tcp->doff * 4;
+
+    /* Sanity check packet field is valid */
+    if (hdr_size < sizeof(*tcp))
+        return -1;
+
+    if ((void *)tcp + hdr_size > data_end)
+        return -1;
+
+    *nh_off += hdr_size;
+    *tcphdr = tcp;
+
+    return hdr_size;
+}
+
+static __always_inline void backend_flow_closed(__u32 backend_idx) {
+    struct backend_stats *stats = bpf_map_lookup_elem(&backend_stats, &backend_idx);
+    if (stats)
+        stats->active_flows -= 1;
+}
+
+static __always_inline __u64 flow_timeout(const struct flow_state *flow) {
+    if (flow->state == FLOW_STATE_CLOSING)
+        return l4_lb_cfg.flow_closing_timeout_ns;
+    return l4_lb_cfg.flow_idle_timeout_ns;
+}
+
+static __always_inline __u32 flow_hash(const struct connection *conn) {
+    __u32 ports = ((__u32)conn->src_port << 16) | conn->dst_port;
+
+    if (conn->ipv6)
+        return jhash_3words(jhash(conn->src_addr6, sizeof(conn->src_addr6), FLOW_HASH_SEED),
+                            jhash(conn->dst_addr6, sizeof(conn->dst_addr6), FLOW_HASH_SEED),
+                            ports, FLOW_HASH_SEED);
+
+    return jhash_3words(conn->src_addr, conn->dst_addr, ports, FLOW_HASH_SEED);
+}
+
+/* Shard of the connection table that holds the flow. It is picked from the
+ * flow key rather than meta->hash, which comes from the NIC for some packets
+ * and from software for others.
+ */
+static __always_inline void *conntrack_shard(const struct connection *conn) {
+    __u32 x = conn->src_addr6[0] ^ conn->src_addr6[1] ^ conn->src_addr6[2] ^ conn->src_addr6[3] ^
+              (((__u32)conn->src_port << 16) | conn->dst_port);
+    __u32 shard = (x * 0x9e3779b1) >> (32 - CONNTRACK_SHARD_BITS);
+
+    return bpf_map_lookup_elem(&connections_map, &shard);
+}
+
+/* Find the service of the flow, falling back to the wildcard port of its VIP */
+static __always_inline struct service *lookup_service(const struct connection *conn) {
+    struct service_key key = {
+        .port = conn->dst_port,
+        .proto = conn->proto,
+        .ipv6 = conn->ipv6,
+    };
+    struct service *svc;
+
+    memcpy(key.vip6, conn->dst_addr6, sizeof(key.vip6));
+
+    svc = bpf_map_lookup_elem(&services_map, &key);
+    if (svc)
+        return svc;
+
+    key.port = 0;
+    return bpf_map_lookup_elem(&services_map, &key);
+}
+
+/* Take a token from the bucket of the flow's client, 0 if there was one. The
+ * buckets are shared by all CPUs without a lock, so packets of one client
+ * arriving on several CPUs at the same instant may get a few tokens too many.
+ */
+static __always_inline int ratelimit_take(const struct connection *conn,
+                                          const struct service *svc) {
+    struct ratelimit_key key = {
+        .service = svc->ring,
+        .ipv6 = conn->ipv6,
+    };
+    __u64 now = bpf_ktime_get_ns();
+    __u64 *full_at;
+
+    memcpy(key.addr, conn->src_addr6, sizeof(key.addr));
+
+    full_at = bpf_map_lookup_elem(&ratelimit_map, &key);
+    if (!full_at) {
+        __u64 first = now + svc->rate_interval_ns;
+        bpf_map_update_elem(&ratelimit_map, &key, &first, BPF_ANY);
+        return 0;
+    }
+
+    // a bucket that filled up while the client was quiet starts over at full
+    __u64 next = *full_at > now ? *full_at : now;
+    next += svc->rate_interval_ns;
+    if (next - now > svc->rate_burst_ns) {
+        __u32 slot = svc->ring;
+        __u64 *drops = bpf_map_lookup_elem(&ratelimit_drops, &slot);
+        if (drops)
+            *drops += 1;
+        return -1;
+    }
+
+    *full_at = next;
+    return 0;
+}
+
+static __always_inline int select_maglev(__u32 ring, __u32 hash) {
+    __u32 slot = ring * MAGLEV_TABLE_SIZE + hash % MAGLEV_TABLE_SIZE;
+    __u32 *backend_idx = bpf_map_lookup_elem(&maglev_map, &slot);
+
+    if (!backend_idx || *backend_idx == MAGLEV_NO_BACKEND)
+        return -1;
+
+    return *backend_idx;
+}
+
+/* Number of live connections of a backend, as last published by the control plane */
+static __always_inline __u64 backend_load(int i) {
     struct backend *tmp = bpf_map_lookup_elem(&backend_map, &i);
     if (!tmp) {
         return UINT32_MAX;
     }
-    bpf_printk("backend= %d flows= %d packets= %d load= %d", i, tmp->num_flows, tmp->num_packets,
-               tmp->num_packets / tmp->num_flows);
-    return tmp->num_packets / tmp->num_flows;
+    return tmp->score;
 }
 
-SEC("xdp")
-int l4_lb(struct xdp_md *ctx) {
+static __always_inline int backend_full(int i) {
+    struct backend *be = bpf_map_lookup_elem(&backend_map, &i);
+
+    return be && be->max_conns && be->score >= be->max_conns;
+}
+
+/* Keep a new flow off backends at their connection cap by trying other random
+ * slots of the ring. The caps are checked against the score, so they are only
+ * as exact as the flows that arrive within one refresh of it.
+ */
+static __always_inline int select_below_cap(__u32 ring, int backend_idx) {
+    for (int i = 0; i < CAP_RETRIES; i++) {
+        if (backend_idx < 0 || !backend_full(backend_idx))
+            return backend_idx;
+        backend_idx = select_maglev(ring, bpf_get_prandom_u32());
+    }
+
+    if (backend_idx < 0 || !backend_full(backend_idx))
+        return backend_idx;
+
+    lb_stat_inc(LB_STAT_BACKEND_FULL);
+    return -1;
+}
+
+/* The score is only refreshed periodically, so always going for the minimum
+ * would send every new flow to the same backend until the next refresh. Take
+ * the less loaded of two random backends out of the service's Maglev ring instead
+ * (power of two choices), which also respects the backend weights.
+ */
+static __always_inline int select_least_conn(__u32 ring) {
+    int a = select_maglev(ring, bpf_get_prandom_u32());
+    int b = select_maglev(ring, bpf_get_prandom_u32());
+
+    if (a < 0 || b < 0)
+        return a < 0 ? b : a;
+
+    return backend_load(b) < backend_load(a) ? b : a;
+}
+
+/* Resolve the next hop towards the backend through the kernel's FIB and
+ * neighbour tables. The result is cached, so the lookup only runs once per
+ * backend, CPU and NEXTHOP_CACHE_TTL_NS. Returns NULL if there is no usable
+ * route or neighbour entry.
+ */
+static __always_inline struct nexthop *backend_nexthop(struct xdp_md *ctx, __u32 backend_idx,
+                                                       const struct backend *backend, __u64 now) {
+    struct nexthop *nh = bpf_map_lookup_elem(&nexthop_cache, &backend_idx);
+    if (!nh)
+        return NULL;
+
+    // the slot may have been given to another backend since the lookup
+    if (now < nh->expires && nh->daddr[0] == backend->ip6[0] && nh->daddr[1] == backend->ip6[1] &&
+        nh->daddr[2] == backend->ip6[2] && nh->daddr[3] == backend->ip6[3])
+        return nh->ifindex ? nh : NULL;
+
+    struct bpf_fib_lookup fib = {};
+    fib.ifindex = ctx->ingress_ifindex;
+    if (backend->ipv6) {
+        fib.family = AF_INET6;
+        memcpy(fib.ipv6_dst, backend->ip6, sizeof(fib.ipv6_dst));
+    } else {
+        fib.family = AF_INET;
+        fib.ipv4_dst = backend->ip;
+    }
+
+    memcpy(nh->daddr, backend->ip6, sizeof(nh->daddr));
+    if (bpf_fib_lookup(ctx, &fib, sizeof(fib), 0) != BPF_FIB_LKUP_RET_SUCCESS) {
+        lb_stat_inc(LB_STAT_FIB_FAILED);
+        nh->ifindex = 0;
+        nh->expires = now + NEXTHOP_FAIL_TTL_NS;
+        return NULL;
+    }
+
+    memcpy(nh->mac, fib.dmac, ETH_ALEN);
+    memcpy((__u8 *)nh->mac + ETH_ALEN, fib.smac, ETH_ALEN);
+    nh->ifindex = fib.ifindex;
+    nh->expires = now + NEXTHOP_CACHE_TTL_NS;
+    return nh;
+}
+
+/* Copy the first `words` 16 bit words of the backend's outer header template
+ * to the front of the packet and put in the MAC addresses of the next hop. If
+ * it isn't known and the control plane doesn't know a gateway either, the MAC
+ * addresses are swapped from the old Ethernet header, which starts `encap_len`
+ * bytes after the new one.
+ */
+static __always_inline int encap_copy_template(const struct backend *backend,
+                                               const struct nexthop *nh, void *data,
+                                               void *data_end, int encap_len, const int words) {
+    __u16 *hdr = data;
+    __u16 *old_eth = data + encap_len;
+    __u16 mac[6] = {};
+
+    if ((void *)(old_eth + ENCAP_ETH_WORDS) > data_end || (void *)(hdr + words) > data_end)
+        return -1;
+
+    if (nh) {
+#pragma unroll
+        for (int i = 0; i < 6; i++)
+            mac[i] = nh->mac[i];
+    } else if (backend->reflect_mac) {
+        // the old header overlaps the new one, take the addresses before overwriting it
+#pragma unroll
+        for (int i = 0; i < 6; i++)
+            mac[i] = old_eth[(i + 3) % 6];
+    }
+
+#pragma unroll
+    for (int i = 0; i < words; i++)
+        hdr[i] = backend->encap[i];
+
+    if (nh || backend->reflect_mac) {
+#pragma unroll
+        for (int i = 0; i < 6; i++)
+            hdr[i] = mac[i];
+    }
+
+    return 0;
+}
+
+/* Source port of the outer UDP header. It is taken from the flow hash out of
+ * the ephemeral range so that the backend's NIC spreads the flows over its
+ * receive queues but keeps every flow on one.
+ */
+static __always_inline __be16 encap_udp_sport(__u32 hash) {
+    return bpf_htons(0xc000 | (hash & 0x3fff));
+}
+
+/* Encapsulate the IPv4 packet in a new IPv4 header towards the backend, with
+ * `udp_len` bytes of UDP/GUE header in between. The control plane prepared the
+ * outer Ethernet and IP header, only the protocol, the lengths, the source
+ * address and the checksum depend on the packet or the encapsulation.
+ */
+static __always_inline int encap_ipv4(struct xdp_md *ctx, const struct backend *backend,
+                                      const struct nexthop *nh, __u32 hash, const int udp_len) {
+    const int encap_len = sizeof(struct iphdr) + udp_len;
+    const __u8 protocol = udp_len ? IPPROTO_UDP : IPPROTO_IPIP;
+    void *data_end;
+    void *data;
+
+    if (bpf_xdp_adjust_head(ctx, 0 - encap_len) != 0) {
+        lb_stat_inc(LB_STAT_ENCAP_FAILED);
+        return XDP_DROP;
+    }
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+
+    if (encap_copy_template(backend, nh, data, data_end, encap_len, ENCAP_IPV4_WORDS) < 0)
+        return XDP_ABORTED;
+
+    struct iphdr *outer_iphdr;
+    struct iphdr *iphdr;
+    outer_iphdr = data + sizeof(struct ethhdr);
+    iphdr = (void *)outer_iphdr + encap_len;
+
+    if ((void *)iphdr + sizeof(struct iphdr) > data_end)
+        return XDP_ABORTED;
+
+    __u16 inner_len = bpf_ntohs(iphdr->tot_len);
+    outer_iphdr->protocol = protocol;
+    outer_iphdr->tot_len = bpf_htons(inner_len + encap_len);
+    outer_iphdr->saddr = iphdr->saddr;
+
+    if (udp_len) {
+        struct udphdr *udphdr = (void *)outer_iphdr + sizeof(*outer_iphdr);
+
+        // the checksum stays 0, which is allowed for UDP over IPv4
+        udphdr->source = encap_udp_sport(hash);
+        udphdr->dest = l4_lb_runtime.encap_port;
+        udphdr->len = bpf_htons(inner_len + udp_len);
+        udphdr->check = 0;
+
+        if (udp_len > sizeof(*udphdr)) {
+            struct guehdr *guehdr = (void *)udphdr + sizeof(*udphdr);
+
+            guehdr->hlen_ver = 0;
+            guehdr->proto_ctype = IPPROTO_IPIP;
+            guehdr->flags = 0;
+        }
+    }
+
+    // the protocol is the low byte of the ttl/protocol word the template left at 0
+    __u32 csum = backend->csum_partial;
+    csum += bpf_htons(protocol);
+    csum += outer_iphdr->tot_len;
+    csum += (outer_iphdr->saddr & 0xffff) + (outer_iphdr->saddr >> 16);
+    outer_iphdr->check = csum_fold(csum);
+
+    ipv4_decrease_ttl(iphdr);
+
+    return XDP_TX;
+}
+
+/* Encapsulate the IPv6 packet in a new IPv6 header towards the backend, with
+ * `udp_len` bytes of UDP/GUE header in between. IPv6 has no header checksum,
+ * so this is cheaper than the IPv4 path.
+ */
+static __always_inline int encap_ipv6(struct xdp_md *ctx, const struct backend *backend,
+                                      const struct nexthop *nh, __u32 hash, const int udp_len) {
+    const int encap_len = sizeof(struct ipv6hdr) + udp_len;
+    void *data_end;
+    void *data;
+
+    if (bpf_xdp_adjust_head(ctx, 0 - encap_len) != 0) {
+        lb_stat_inc(LB_STAT_ENCAP_FAILED);
+        return XDP_DROP;
+    }
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+
+    if (encap_copy_template(backend, nh, data, data_end, encap_len, ENCAP_ETH_WORDS) < 0)
+        return XDP_ABORTED;
+
+    struct ipv6hdr *outer_ip6hdr;
+    struct ipv6hdr *ip6hdr;
+    outer_ip6hdr = data + sizeof(struct ethhdr);
+    ip6hdr = (void *)outer_ip6hdr + encap_len;
+
+    if ((void *)outer_ip6hdr + sizeof(struct ipv6hdr) > data_end ||
+        (void *)ip6hdr + sizeof(struct ipv6hdr) > data_end)
+        return XDP_ABORTED;
+
+    __u16 inner_len = bpf_ntohs(ip6hdr->payload_len) + sizeof(*ip6hdr);
+    outer_ip6hdr->version = 6;
+    outer_ip6hdr->priority = 0;
+    // derive the flow label from the flow so that ECMP paths keep it together
+    outer_ip6hdr->flow_lbl[0] = (hash >> 16) & 0x0f;
+    outer_ip6hdr->flow_lbl[1] = (hash >> 8) & 0xff;
+    outer_ip6hdr->flow_lbl[2] = hash & 0xff;
+    outer_ip6hdr->payload_len = bpf_htons(inner_len + udp_len);
+    outer_ip6hdr->nexthdr = udp_len ? IPPROTO_UDP : IPPROTO_IPV6;
+    outer_ip6hdr->hop_limit = ip6hdr->hop_limit;
+    memcpy(&outer_ip6hdr->saddr, &ip6hdr->saddr, sizeof(outer_ip6hdr->saddr));
+    memcpy(&outer_ip6hdr->daddr, backend->ip6, sizeof(outer_ip6hdr->daddr));
+
+    if (udp_len) {
+        struct udphdr *udphdr = (void *)outer_ip6hdr + sizeof(*outer_ip6hdr);
+
+        /* A zero checksum saves summing up the whole packet. The FOU/GUE
+         * receive sockets of the kernel accept it for IPv6 (RFC 6935).
+         */
+        udphdr->source = encap_udp_sport(hash);
+        udphdr->dest = l4_lb_runtime.encap_port;
+        udphdr->len = bpf_htons(inner_len + udp_len);
+        udphdr->check = 0;
+
+        if (udp_len > sizeof(*udphdr)) {
+            struct guehdr *guehdr = (void *)udphdr + sizeof(*udphdr);
+
+            guehdr->hlen_ver = 0;
+            guehdr->proto_ctype = IPPROTO_IPV6;
+            guehdr->flags = 0;
+        }
+    }
+
+    ip6hdr->hop_limit -= 1;
+
+    return XDP_TX;
+}
+
+/* Turn an IPv4 packet with DF that is too big for the tunnel into an ICMP
+ * "fragmentation needed" error advertising `mtu`, sent back to the client from
+ * the VIP. The client lowers its path MTU right away instead of waiting for
+ * retransmissions that get dropped further down.
+ */
+static __always_inline int icmp4_too_big(struct xdp_md *ctx, __u16 mtu) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct ethhdr *eth = data;
+    struct iphdr *iphdr = data + sizeof(*eth);
+
+    // with IP options the quote would miss the ports the client needs to match it
+    if ((void *)(iphdr + 1) > data_end || iphdr->ihl != sizeof(*iphdr) / 4)
+        return XDP_DROP;
+
+    struct ethhdr eth_copy = *eth;
+    __be32 client = iphdr->saddr;
+    __be32 vip = iphdr->daddr;
+    int keep = sizeof(*eth) + ICMP_QUOTE_LEN;
+
+    /* Cut the packet after the quoted part, then make room for the new IP and
+     * ICMP header. The new Ethernet header ends up where the new IP header
+     * was, the old one is overwritten.
+     */
+    if (bpf_xdp_adjust_tail(ctx, keep - (int)(data_end - data)) != 0 ||
+        bpf_xdp_adjust_head(ctx, 0 - (int)(sizeof(struct iphdr) + sizeof(struct icmphdr))) != 0)
+        return XDP_DROP;
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+    eth = data;
+    iphdr = data + sizeof(*eth);
+    struct icmphdr *icmphdr = (void *)(iphdr + 1);
+
+    if ((void *)icmphdr + sizeof(*icmphdr) + ICMP_QUOTE_LEN > data_end)
+        return XDP_DROP;
+
+    memcpy(eth->h_dest, eth_copy.h_source, ETH_ALEN);
+    memcpy(eth->h_source, eth_copy.h_dest, ETH_ALEN);
+    eth->h_proto = bpf_htons(ETH_P_IP);
+
+    icmphdr->type = ICMP_DEST_UNREACH;
+    icmphdr->code = ICMP_FRAG_NEEDED;
+    icmphdr->checksum = 0;
+    icmphdr->un.frag.__unused = 0;
+    icmphdr->un.frag.mtu = bpf_htons(mtu);
+    icmphdr->checksum = csum_fold(
+        bpf_csum_diff(NULL, 0, (void *)icmphdr, sizeof(*icmphdr) + ICMP_QUOTE_LEN, 0));
+
+    iphdr->version = 4;
+    iphdr->ihl = sizeof(*iphdr) / 4;
+    iphdr->tos = 0;
+    iphdr->tot_len = bpf_htons(sizeof(*iphdr) + sizeof(*icmphdr) + ICMP_QUOTE_LEN);
+    iphdr->id = 0;
+    iphdr->frag_off = 0;
+    iphdr->ttl = ENCAP_TTL;
+    iphdr->protocol = IPPROTO_ICMP;
+    iphdr->check = 0;
+    iphdr->saddr = vip;
+    iphdr->daddr = client;
+    iphdr->check = csum_fold(bpf_csum_diff(NULL, 0, (void *)iphdr, sizeof(*iphdr), 0));
+
+    lb_stat_inc(LB_STAT_ICMP_TOO_BIG);
+    return XDP_TX;
+}
+
+/* Same as icmp4_too_big() with an ICMPv6 "packet too big" error. IPv6 routers
+ * never fragment, so this is sent for every packet that doesn't fit.
+ */
+static __always_inline int icmp6_too_big(struct xdp_md *ctx, __u32 mtu) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct ethhdr *eth = data;
+    struct ipv6hdr *ip6hdr = data + sizeof(*eth);
+
+    if ((void *)(ip6hdr + 1) > data_end)
+        return XDP_DROP;
+
+    struct ethhdr eth_copy = *eth;
+    struct in6_addr client = ip6hdr->saddr;
+    struct in6_addr vip = ip6hdr->daddr;
+    int keep = sizeof(*eth) + ICMP6_QUOTE_LEN;
+
+    if (bpf_xdp_adjust_tail(ctx, keep - (int)(data_end - data)) != 0 ||
+        bpf_xdp_adjust_head(ctx, 0 - (int)(sizeof(struct ipv6hdr) + sizeof(struct icmp6hdr))) != 0)
+        return XDP_DROP;
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+    eth = data;
+    ip6hdr = data + sizeof(*eth);
+    struct icmp6hdr *icmp6hdr = (void *)(ip6hdr + 1);
+
+    if ((void *)icmp6hdr + sizeof(*icmp6hdr) + ICMP6_QUOTE_LEN > data_end)
+        return XDP_DROP;
+
+    memcpy(eth->h_dest, eth_copy.h_source, ETH_ALEN);
+    memcpy(eth->h_source, eth_copy.h_dest, ETH_ALEN);
+    eth->h_proto = bpf_htons(ETH_P_IPV6);
+
+    __u16 payload_len = sizeof(*icmp6hdr) + ICMP6_QUOTE_LEN;
+    ip6hdr->version = 6;
+    ip6hdr->priority = 0;
+    memset(ip6hdr->flow_lbl, 0, sizeof(ip6hdr->flow_lbl));
+    ip6hdr->payload_len = bpf_htons(payload_len);
+    ip6hdr->nexthdr = IPPROTO_ICMPV6;
+    ip6hdr->hop_limit = ENCAP_TTL;
+    ip6hdr->saddr = vip;
+    ip6hdr->daddr = client;
+
+    icmp6hdr->icmp6_type = ICMPV6_PKT_TOOBIG;
+    icmp6hdr->icmp6_code = 0;
+    icmp6hdr->icmp6_cksum = 0;
+    icmp6hdr->icmp6_mtu = bpf_htonl(mtu < IPV6_MIN_MTU ? IPV6_MIN_MTU : mtu);
+
+    // pseudo header: addresses, upper-layer length and next header
+    __be32 pseudo[2] = {bpf_htonl(payload_len), bpf_htonl(IPPROTO_ICMPV6)};
+    __u32 csum = bpf_csum_diff(NULL, 0, (void *)&ip6hdr->saddr, 2 * sizeof(struct in6_addr), 0);
+    csum = bpf_csum_diff(NULL, 0, pseudo, sizeof(pseudo), csum);
+    csum = bpf_csum_diff(NULL, 0, (void *)icmp6hdr, payload_len, csum);
+    icmp6hdr->icmp6_cksum = csum_fold(csum);
+
+    lb_stat_inc(LB_STAT_ICMP_TOO_BIG);
+    return XDP_TX;
+}
+
+static __always_inline struct lb_meta *meta_get(struct xdp_md *ctx) {
+    void *data = (void *)(long)ctx->data;
+    struct lb_meta *meta = (void *)(long)ctx->data_meta;
+
+    if ((void *)(meta + 1) > data)
+        return NULL;
+
+    return meta;
+}
+
+/* Hand the packet to the stage `ret` of the current one asks for, which only
+ * returns on failure. Any other `ret` is the final action.
+ */
+static __always_inline int next_stage(struct xdp_md *ctx, int ret) {
+    if (ret == LB_NEXT_SELECT)
+        bpf_tail_call(ctx, &lb_stages, LB_STAGE_SELECT);
+    else if (ret == LB_NEXT_ENCAP)
+        bpf_tail_call(ctx, &lb_stages, LB_STAGE_ENCAP);
+    else
+        return ret;
+
+    lb_stat_inc(LB_STAT_TAIL_CALL_FAILED);
+    return XDP_DROP;
+}
+
+/* Flow hash of the packet. With `rx_hash` the NIC's RSS hash is used if it
+ * covers the ports, which saves hashing the flow key in software.
+ */
+static __always_inline __u32 packet_hash(struct xdp_md *ctx, const struct connection *conn,
+                                         const int rx_hash) {
+    if (rx_hash && bpf_ksym_exists(bpf_xdp_metadata_rx_hash)) {
+        enum xdp_rss_hash_type type = 0;
+        __u32 hash;
+
+        if (bpf_xdp_metadata_rx_hash(ctx, &hash, &type) == 0 && (type & XDP_RSS_L4))
+            return hash;
+        lb_stat_inc(LB_STAT_RX_HASH_MISSING);
+    }
+
+    return flow_hash(conn);
+}
+
+/* Read the flow key of the packet from the offsets the parse stage found */
+static __always_inline int load_connection(void *data, void *data_end, const struct lb_meta *meta,
+                                           struct connection *conn) {
+    if (meta->flags & LB_META_IPV6) {
+        struct ipv6hdr *ip6hdr = data + sizeof(struct ethhdr);
+
+        if ((void *)ip6hdr + sizeof(*ip6hdr) > data_end)
+            return -1;
+
+        memcpy(conn->dst_addr6, &ip6hdr->daddr, sizeof(conn->dst_addr6));
+        memcpy(conn->src_addr6, &ip6hdr->saddr, sizeof(conn->src_addr6));
+        conn->ipv6 = 1;
+    } else {
+        struct iphdr *iphdr = data + sizeof(struct ethhdr);
+
+        if ((void *)iphdr + sizeof(*iphdr) > data_end)
+            return -1;
+
+        conn->dst_addr = iphdr->daddr;
+        conn->src_addr = iphdr->saddr;
+    }
+
+    // UDP and TCP both start with the source and destination port
+    __u16 l4_off = meta->l4_off;
+    if (l4_off > MAX_L4_OFF)
+        return -1;
+
+    __be16 *ports = data + l4_off;
+    if ((void *)(ports + 2) > data_end)
+        return -1;
+
+    conn->src_port = ports[0];
+    conn->dst_port = ports[1];
+    conn->proto = meta->proto;
+
+    return 0;
+}
+
+static __always_inline void frag_key_init(struct frag_key *key, const struct iphdr *iphdr) {
+    key->src_addr = iphdr->saddr;
+    key->dst_addr = iphdr->daddr;
+    key->id = iphdr->id;
+    key->proto = iphdr->protocol;
+    key->pad = 0;
+}
+
+/* Send a non-first fragment after the first one of its datagram, straight to
+ * the encap stage. Without a recorded first fragment it is either not for a
+ * service at all or overtook the first one, and both are left to the stack.
+ */
+static __always_inline int frag_forward(struct xdp_md *ctx, const struct iphdr *iphdr) {
+    struct frag_key key;
+
+    frag_key_init(&key, iphdr);
+    struct frag_state *frag = bpf_map_lookup_elem(&frag_map, &key);
+    if (!frag) {
+        lb_stat_inc(LB_STAT_FRAG_UNKNOWN);
+        return XDP_PASS;
+    }
+
+    __u32 backend_idx = frag->backend_idx;
+    __u32 hash = frag->hash;
+
+    // the rest of a datagram counts against the client's rate as well
+    struct connection conn = {
+        .dst_addr = iphdr->daddr,
+        .src_addr = iphdr->saddr,
+        .dst_port = frag->dst_port,
+        .proto = iphdr->protocol,
+    };
+    struct service *svc = lookup_service(&conn);
+    if (svc) {
+        struct service svc_copy = *svc;
+        if (svc_copy.rate_interval_ns && ratelimit_take(&conn, &svc_copy) < 0)
+            return XDP_DROP;
+    }
+
+    struct backend *backend = bpf_map_lookup_elem(&backend_map, &backend_idx);
+    if (!backend || !backend->up)
+        return XDP_DROP;
+
+    if (bpf_xdp_adjust_meta(ctx, 0 - (int)sizeof(struct lb_meta)) != 0) {
+        lb_stat_inc(LB_STAT_TAIL_CALL_FAILED);
+        return XDP_DROP;
+    }
+
+    struct lb_meta *meta = meta_get(ctx);
+    if (!meta)
+        return XDP_ABORTED;
+
+    meta->hash = hash;
+    meta->backend_idx = backend_idx;
+    meta->now = bpf_ktime_get_ns();
+    meta->flags = 0;
+    lb_stat_inc(LB_STAT_FRAGMENTS);
+
+    return LB_NEXT_ENCAP;
+}
+
+/* Stage 1, attached to the interface: parse the packet, pass everything that
+ * is not for one of our services and hand the rest to the select stage.
+ */
+static __always_inline int parse_stage(struct xdp_md *ctx, const int rx_hash) {
     void *data_end;
     void *data;
     data_end = (void *)(long)ctx->data_end;
@@ -144,131 +1090,685 @@ int l4_lb(struct xdp_md *ctx) {
     struct ethhdr *eth;
     int eth_type;
 
-    bpf_printk("Packet received");
-
     eth_type = parse_ethhdr(data, data_end, &nf_off, &eth);
 
-    if (eth_type != bpf_ntohs(ETH_P_IP))
+    struct connection conn = {};
+    __u8 flags = 0;
+    int ip_type;
+
+    if (eth_type == bpf_htons(ETH_P_IP)) {
+        struct iphdr *iphdr;
+        ip_type = parse_iphdr(data, data_end, &nf_off, &iphdr);
+        if (ip_type < 0)
+            goto pass;
+
+        // only the first fragment of a datagram has the L4 header
+        if (iphdr->frag_off & bpf_htons(IP_OFFSET)) {
+            if (ip_type != IPPROTO_UDP && ip_type != IPPROTO_TCP)
+                goto pass;
+            return frag_forward(ctx, iphdr);
+        }
+        if (iphdr->frag_off & bpf_htons(IP_MF))
+            flags |= LB_META_FRAG;
+
+        conn.dst_addr = iphdr->daddr;
+        conn.src_addr = iphdr->saddr;
+    } else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+        struct ipv6hdr *ip6hdr;
+        ip_type = parse_ipv6hdr(data, data_end, &nf_off, &ip6hdr);
+        if (ip_type < 0)
+            goto pass;
+
+        memcpy(conn.dst_addr6, &ip6hdr->daddr, sizeof(conn.dst_addr6));
+        memcpy(conn.src_addr6, &ip6hdr->saddr, sizeof(conn.src_addr6));
+        conn.ipv6 = 1;
+    } else {
         goto pass;
+    }
 
-    bpf_printk("Packet is IPv4");
+    __u16 l4_off = nf_off;
+    __be16 dst_port;
+    __be16 src_port;
+    if (conn.ipv6)
+        flags |= LB_META_IPV6;
 
-    // Handle IPv4 and parse ICMP
-    int ip_type;
-    struct iphdr *iphdr;
-    ip_type = parse_iphdr(data, data_end, &nf_off, &iphdr);
+    if (ip_type == IPPROTO_UDP) {
+        struct udphdr *udphdr;
+        if (parse_udphdr(data, data_end, &nf_off, &udphdr) < 0)
+            goto pass;
+
+        dst_port = udphdr->dest;
+        src_port = udphdr->source;
+    } else if (ip_type == IPPROTO_TCP) {
+        struct tcphdr *tcphdr;
+        if (parse_tcphdr(data, data_end, &nf_off, &tcphdr) < 0)
+            goto pass;
+
+        dst_port = tcphdr->dest;
+        src_port = tcphdr->source;
+        if (tcphdr->syn && !tcphdr->ack)
+            flags |= LB_META_TCP_SYN;
+        if (tcphdr->fin)
+            flags |= LB_META_TCP_FIN;
+        if (tcphdr->rst)
+            flags |= LB_META_TCP_RST;
+    } else {
+        goto pass;
+    }
+
+    conn.dst_port = dst_port;
+    conn.src_port = src_port;
+    conn.proto = ip_type;
 
-    if (ip_type != IPPROTO_UDP)
+    // traffic that is not addressed to one of our services belongs to the stack
+    struct service *svc = lookup_service(&conn);
+    if (!svc)
         goto pass;
-    bpf_printk("Packet is UDP");
 
-    struct udphdr *udphdr;
-    if (parse_udphdr(data, data_end, &nf_off, &udphdr) < 0)
-        goto drop;
+    // read ring and generation together, the control plane may replace the entry
+    struct service svc_copy = *svc;
 
-    __be32 dst_addr = iphdr->daddr;
-    __be32 src_addr = iphdr->saddr;
-    __be16 dst_port = udphdr->dest;
-    __be16 src_port = udphdr->source;
+    // clients over their rate don't get to create any state
+    if (svc_copy.rate_interval_ns && ratelimit_take(&conn, &svc_copy) < 0)
+        return XDP_DROP;
 
-    struct connection conn = {
-        .dst_addr = dst_addr,
-        .src_addr = src_addr,
-        .dst_port = dst_port,
-        .src_port = src_port,
-    };
+    __u32 hash = packet_hash(ctx, &conn, rx_hash);
+
+    if (bpf_xdp_adjust_meta(ctx, 0 - (int)sizeof(struct lb_meta)) != 0) {
+        lb_stat_inc(LB_STAT_TAIL_CALL_FAILED);
+        return XDP_DROP;
+    }
+
+    struct lb_meta *meta = meta_get(ctx);
+    if (!meta)
+        return XDP_ABORTED;
+
+    meta->hash = hash;
+    meta->ring = svc_copy.ring * MAGLEV_RING_COPIES + (svc_copy.gen & 1);
+    meta->l4_off = l4_off;
+    meta->proto = ip_type;
+    meta->flags = flags;
+
+    return LB_NEXT_SELECT;
+
+pass:
+    return XDP_PASS;
+}
+
+SEC("xdp")
+int l4_lb(struct xdp_md *ctx) {
+    return next_stage(ctx, parse_stage(ctx, 0));
+}
+
+static __always_inline void client_key_init(struct client_key *key, const struct connection *conn) {
+    memset(key, 0, sizeof(*key));
+    if (conn->ipv6) {
+        memcpy(key->addr, conn->src_addr6, sizeof(key->addr));
+        key->ipv6 = 1;
+    } else {
+        key->addr[0] = conn->src_addr;
+    }
+}
+
+static __always_inline int client_verified(const struct connection *conn, __u64 now) {
+    struct client_key key;
+
+    client_key_init(&key, conn);
+    __u64 *verified_at = bpf_map_lookup_elem(&syn_verified, &key);
+
+    return verified_at && now - *verified_at < SYN_VERIFIED_TTL_NS;
+}
+
+/* Sum of the TCP pseudo header and `tcphdr`, whose checksum has to be 0. The
+ * addresses are the ones at `addrs`, which the IP header has next to each other.
+ */
+static __always_inline __u32 tcp_csum(void *addrs, const int addrs_len, struct tcphdr *tcphdr) {
+    __be32 pseudo[2] = {bpf_htonl(sizeof(*tcphdr)), bpf_htonl(IPPROTO_TCP)};
+    __u32 csum;
+
+    csum = bpf_csum_diff(NULL, 0, addrs, addrs_len, 0);
+    csum = bpf_csum_diff(NULL, 0, pseudo, sizeof(pseudo), csum);
+    return bpf_csum_diff(NULL, 0, (void *)tcphdr, sizeof(*tcphdr), csum);
+}
+
+/* Answer a SYN of an unverified client with a SYN-ACK whose acknowledgement
+ * number is a SYN cookie instead of the client's sequence number plus one. A
+ * real client rejects it with a RST carrying the cookie as sequence number and
+ * retransmits its SYN a moment later. Neither the SYN nor the challenge create
+ * any state, so a flood from spoofed addresses can't fill the tables. The TCP
+ * header of the SYN is at `l4_off`, behind any IPv4 options.
+ */
+static __always_inline int syn_cookie_challenge(struct xdp_md *ctx, int ipv6, __u16 l4_off) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct ethhdr *eth = data;
+    struct ethhdr eth_copy;
+    struct tcphdr *tcphdr;
+    __be32 addrs[8];
+    __be16 sport, dport;
+    __s64 cookie;
+    int ip_len;
+
+    if ((void *)(eth + 1) > data_end || l4_off > MAX_L4_OFF)
+        return XDP_ABORTED;
+    eth_copy = *eth;
+
+    tcphdr = data + l4_off;
+    if ((void *)(tcphdr + 1) > data_end)
+        return XDP_ABORTED;
+
+    /* The cookie covers the addresses, the ports and the client's sequence
+     * number. The RST doesn't carry the latter, so it is left out (set to 0).
+     */
+    if (ipv6) {
+        struct ipv6hdr *ip6hdr = (void *)(eth + 1);
+
+        if ((void *)(ip6hdr + 1) > data_end)
+            return XDP_ABORTED;
+
+        tcphdr->seq = 0;
+        cookie = bpf_tcp_raw_gen_syncookie_ipv6(ip6hdr, tcphdr, sizeof(*tcphdr));
+        memcpy(addrs, &ip6hdr->daddr, sizeof(ip6hdr->daddr));
+        memcpy(addrs + 4, &ip6hdr->saddr, sizeof(ip6hdr->saddr));
+        ip_len = sizeof(*ip6hdr);
+    } else {
+        struct iphdr *iphdr = (void *)(eth + 1);
+
+        if ((void *)(iphdr + 1) > data_end)
+            return XDP_ABORTED;
+
+        tcphdr->seq = 0;
+        cookie = bpf_tcp_raw_gen_syncookie_ipv4(iphdr, tcphdr, sizeof(*tcphdr));
+        addrs[0] = iphdr->daddr;
+        addrs[1] = iphdr->saddr;
+        ip_len = sizeof(*iphdr);
+    }
+    if (cookie < 0)
+        return XDP_DROP;
+
+    sport = tcphdr->dest;
+    dport = tcphdr->source;
+
+    // IP options, TCP options and payload of the SYN are not needed
+    int len = sizeof(*eth) + ip_len + sizeof(*tcphdr);
+    if (bpf_xdp_adjust_tail(ctx, len - (int)(data_end - data)) != 0)
+        return XDP_DROP;
+
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
+    eth = data;
+    if ((void *)(eth + 1) > data_end)
+        return XDP_ABORTED;
+
+    memcpy(eth->h_dest, eth_copy.h_source, ETH_ALEN);
+    memcpy(eth->h_source, eth_copy.h_dest, ETH_ALEN);
+
+    if (ipv6) {
+        struct ipv6hdr *ip6hdr = (void *)(eth + 1);
+
+        tcphdr = (void *)(ip6hdr + 1);
+        if ((void *)(tcphdr + 1) > data_end)
+            return XDP_ABORTED;
 
-    struct backend *backend;
-    int *backend_idx_ptr = bpf_map_lookup_elem(&connections_map, &conn);
+        ip6hdr->payload_len = bpf_htons(sizeof(*tcphdr));
+        ip6hdr->hop_limit = ENCAP_TTL;
+        memcpy(&ip6hdr->saddr, addrs, sizeof(ip6hdr->saddr));
+        memcpy(&ip6hdr->daddr, addrs + 4, sizeof(ip6hdr->daddr));
+    } else {
+        struct iphdr *iphdr = (void *)(eth + 1);
+
+        tcphdr = (void *)(iphdr + 1);
+        if ((void *)(tcphdr + 1) > data_end)
+            return XDP_ABORTED;
+
+        iphdr->ihl = sizeof(*iphdr) / 4;
+        iphdr->tos = 0;
+        iphdr->tot_len = bpf_htons(sizeof(*iphdr) + sizeof(*tcphdr));
+        iphdr->id = 0;
+        iphdr->frag_off = bpf_htons(IP_DF);
+        iphdr->ttl = ENCAP_TTL;
+        iphdr->saddr = addrs[0];
+        iphdr->daddr = addrs[1];
+        iphdr->check = 0;
+        iphdr->check = csum_fold(bpf_csum_diff(NULL, 0, (void *)iphdr, sizeof(*iphdr), 0));
+    }
+
+    tcphdr->source = sport;
+    tcphdr->dest = dport;
+    tcphdr->seq = bpf_get_prandom_u32();
+    tcphdr->ack_seq = bpf_htonl((__u32)cookie);
+    tcp_flag_word(tcphdr) = TCP_FLAG_SYN | TCP_FLAG_ACK | bpf_htonl(5 << 28 | SYN_COOKIE_WINDOW);
+    tcphdr->check = 0;
+    tcphdr->urg_ptr = 0;
+
+    if (ipv6) {
+        struct ipv6hdr *ip6hdr = (void *)(eth + 1);
+
+        if ((void *)(ip6hdr + 1) > data_end)
+            return XDP_ABORTED;
+        tcphdr->check = csum_fold(tcp_csum(&ip6hdr->saddr, 2 * sizeof(struct in6_addr), tcphdr));
+    } else {
+        struct iphdr *iphdr = (void *)(eth + 1);
+
+        if ((void *)(iphdr + 1) > data_end)
+            return XDP_ABORTED;
+        tcphdr->check = csum_fold(tcp_csum(&iphdr->saddr, 2 * sizeof(__be32), tcphdr));
+    }
+
+    lb_stat_inc(LB_STAT_SYN_CHALLENGED);
+    return XDP_TX;
+}
+
+/* Check if the RST is a client's answer to syn_cookie_challenge(), and trust
+ * the client if it is. The RST is rewritten into the ACK the cookie helpers
+ * expect, and restored if it turns out not to be an answer.
+ */
+static __always_inline int syn_cookie_check(struct xdp_md *ctx, const struct connection *conn,
+                                            __u16 l4_off, __u64 now) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct tcphdr *tcphdr;
+    __be32 seq, ack_seq;
+    long err;
+
+    if (l4_off > MAX_L4_OFF)
+        return -1;
+
+    tcphdr = data + l4_off;
+    if ((void *)(tcphdr + 1) > data_end)
+        return -1;
+
+    if (conn->ipv6) {
+        struct ipv6hdr *ip6hdr = data + sizeof(struct ethhdr);
+
+        if ((void *)(ip6hdr + 1) > data_end)
+            return -1;
+
+        seq = tcphdr->seq;
+        ack_seq = tcphdr->ack_seq;
+        tcphdr->seq = bpf_htonl(1);
+        tcphdr->ack_seq = bpf_htonl(bpf_ntohl(seq) + 1);
+        err = bpf_tcp_raw_check_syncookie_ipv6(ip6hdr, tcphdr);
+    } else {
+        struct iphdr *iphdr = data + sizeof(struct ethhdr);
+
+        if ((void *)(iphdr + 1) > data_end)
+            return -1;
+
+        seq = tcphdr->seq;
+        ack_seq = tcphdr->ack_seq;
+        tcphdr->seq = bpf_htonl(1);
+        tcphdr->ack_seq = bpf_htonl(bpf_ntohl(seq) + 1);
+        err = bpf_tcp_raw_check_syncookie_ipv4(iphdr, tcphdr);
+    }
+
+    if (err) {
+        tcphdr->seq = seq;
+        tcphdr->ack_seq = ack_seq;
+        return -1;
+    }
+
+    struct client_key key;
+    client_key_init(&key, conn);
+    bpf_map_update_elem(&syn_verified, &key, &now, BPF_ANY);
+    lb_stat_inc(LB_STAT_SYN_VERIFIED);
+
+    return 0;
+}
+
+/* Stage 2: find the backend of the flow in the connection table or pick one
+ * for a new flow by `policy`, and keep the table and counters up to date.
+ */
+static __always_inline int select_stage(struct xdp_md *ctx, const int policy) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct connection conn = {};
+
+    struct lb_meta *meta = meta_get(ctx);
+    if (!meta || load_connection(data, data_end, meta, &conn) < 0)
+        return XDP_ABORTED;
+
+    int tcp_syn = meta->flags & LB_META_TCP_SYN;
+    int tcp_fin = meta->flags & LB_META_TCP_FIN;
+    int tcp_rst = meta->flags & LB_META_TCP_RST;
+
+    void *conntrack = conntrack_shard(&conn);
+    if (!conntrack)
+        return XDP_ABORTED;
+
+    struct backend *backend = NULL;
+    struct flow_state *flow = bpf_map_lookup_elem(conntrack, &conn);
+    __u64 now = bpf_ktime_get_ns();
     int new_flow = 0;
+    int repin = 0;
     int backend_idx = -1;
 
-    if (backend_idx_ptr) {
-        bpf_printk("known flow");
-        backend_idx = *backend_idx_ptr;
+    if (flow) {
+        if (now - flow->last_seen <= flow_timeout(flow)) {
+            backend_idx = flow->backend_idx;
+            backend = bpf_map_lookup_elem(&backend_map, &backend_idx);
+            if (backend && backend->up) {
+                flow->last_seen = now;
+                // a SYN reusing the 5-tuple of a closing flow opens a new connection
+                if (tcp_syn && flow->state == FLOW_STATE_CLOSING)
+                    new_flow = 1;
+            } else {
+                /* The backend finished draining or failed its health checks,
+                 * pick a new one. A backend that comes back must not count
+                 * the flow as still active.
+                 */
+                if (flow->state != FLOW_STATE_CLOSING) {
+                    lb_stat_inc(LB_STAT_FLOWS_REASSIGNED);
+                    backend_flow_closed(flow->backend_idx);
+                    flow->state = FLOW_STATE_CLOSING;
+                    if (flow->logged)
+                        emit_flow_event(&conn, flow->backend_idx, FLOW_EVENT_REASSIGNED, now);
+                }
+                backend_idx = -1;
+                backend = NULL;
+            }
+        } else {
+            // idle for too long, treat it like a new flow
+            if (flow->state != FLOW_STATE_CLOSING) {
+                lb_stat_inc(LB_STAT_FLOWS_EXPIRED);
+                backend_flow_closed(flow->backend_idx);
+                flow->state = FLOW_STATE_CLOSING;
+                if (flow->logged)
+                    emit_flow_event(&conn, flow->backend_idx, FLOW_EVENT_EXPIRED, now);
+            }
+        }
+    }
+
+    if (backend_idx == -1 && conn.proto == IPPROTO_TCP && l4_lb_runtime.syn_cookies) {
+        // new connections only from clients that answered a challenge before
+        if (tcp_syn && !client_verified(&conn, now))
+            return syn_cookie_challenge(ctx, conn.ipv6, meta->l4_off);
+        if (tcp_rst && syn_cookie_check(ctx, &conn, meta->l4_off, now) == 0)
+            return XDP_DROP;
     }
 
     if (backend_idx == -1) {
-        new_flow = 1;
         // conn not assigned to a backend
-        __u32 min_load = UINT32_MAX;
-
-        for (int i = 0; i < l4_lb_cfg.backend_count; i++) {
-            __u64 load = backend_load(i);
-            if (load < min_load) {
-                min_load = load;
-                backend_idx = i;
-            }
+        if (conn.proto == IPPROTO_TCP && !tcp_syn && !flow) {
+            /* Mid-stream packet of a flow we have no state for, e.g. because it
+             * was evicted. Keep it on the backend the Maglev table points to but
+             * don't allocate state: only a SYN opens a connection. Under
+             * least_conn that is usually not the backend the flow started
+             * on, which then resets it.
+             */
+            lb_stat_inc(LB_STAT_TCP_NO_STATE);
+            backend_idx = select_maglev(meta->ring, meta->hash);
+        } else {
+            /* A mid-stream packet of a flow whose backend went away or that
+             * idled out pins the flow to its new backend, so that its next
+             * packets follow. It stays closing, only a SYN opens a connection.
+             */
+            if (conn.proto == IPPROTO_TCP && !tcp_syn)
+                repin = 1;
+            else
+                new_flow = 1;
+            if (policy == LB_POLICY_LEAST_CONN)
+                backend_idx = select_least_conn(meta->ring);
+            else
+                backend_idx = select_maglev(meta->ring, meta->hash);
+            backend_idx = select_below_cap(meta->ring, backend_idx);
         }
     }
 
-    bpf_printk("choosing backend %d", backend_idx);
+    if (backend_idx < 0)
+        return XDP_DROP;
 
-    backend = bpf_map_lookup_elem(&backend_map, &backend_idx);
+    if (!backend)
+        backend = bpf_map_lookup_elem(&backend_map, &backend_idx);
     if (!backend) {
         return XDP_ABORTED;
     }
 
-    __sync_fetch_and_add(&backend->num_packets, 1);
+    // the control plane only puts backends of the VIP's family into a service
+    if (backend->ipv6 != conn.ipv6)
+        return XDP_DROP;
+
+    struct backend_stats *stats = bpf_map_lookup_elem(&backend_stats, &backend_idx);
+    if (!stats)
+        return XDP_ABORTED;
+
+    stats->num_packets += 1;
+    if (repin && flow) {
+        flow->backend_idx = backend_idx;
+        flow->last_seen = now;
+    }
     if (new_flow) {
-        __sync_fetch_and_add(&backend->num_flows, 1);
-        bpf_map_update_elem(&connections_map, &conn, &backend_idx, BPF_ANY);
+        stats->num_flows += 1;
+
+        struct flow_state new_state = {
+            .backend_idx = backend_idx,
+            .state = FLOW_STATE_ACTIVE,
+            .logged = flow_sampled(meta->hash),
+            .last_seen = now,
+        };
+        if (bpf_map_update_elem(conntrack, &conn, &new_state, BPF_ANY) != 0) {
+            lb_stat_inc(LB_STAT_CONNTRACK_FULL);
+        } else {
+            stats->active_flows += 1;
+            if (!flow || tcp_syn)
+                lb_stat_inc(LB_STAT_FLOWS_CREATED);
+            if (new_state.logged)
+                emit_flow_event(&conn, backend_idx, FLOW_EVENT_NEW, now);
+        }
+    } else if (flow && (tcp_fin || tcp_rst)) {
+        if (flow->state != FLOW_STATE_CLOSING) {
+            stats->active_flows -= 1;
+            lb_stat_inc(LB_STAT_FLOWS_CLOSED);
+            if (flow->logged)
+                emit_flow_event(&conn, backend_idx, FLOW_EVENT_CLOSED, now);
+        }
+
+        /* After a RST nothing useful follows. After a FIN keep the flow for the
+         * closing timeout so the remaining FIN/ACKs still reach the backend.
+         */
+        if (tcp_rst) {
+            if (bpf_map_delete_elem(conntrack, &conn) == 0)
+                lb_stat_inc(LB_STAT_FLOWS_RESET);
+        } else {
+            flow->state = FLOW_STATE_CLOSING;
+        }
     }
 
-    // encapsulate packet in new ip packet
+    if (meta->flags & LB_META_FRAG) {
+        struct iphdr *iphdr = data + sizeof(struct ethhdr);
+        struct frag_state frag = {
+            .backend_idx = backend_idx,
+            .hash = meta->hash,
+            .dst_port = conn.dst_port,
+        };
+        struct frag_key key;
 
-    if (bpf_xdp_adjust_head(ctx, 0 - (int)sizeof(struct iphdr)) != 0) {
-        bpf_printk("could not adjust head");
-        return XDP_DROP;
+        if ((void *)(iphdr + 1) > data_end)
+            return XDP_ABORTED;
+
+        frag_key_init(&key, iphdr);
+        bpf_map_update_elem(&frag_map, &key, &frag, BPF_ANY);
     }
 
-    struct ethhdr *old_eth;
+    meta->backend_idx = backend_idx;
+    meta->now = now;
 
-    data_end = (void *)(long)ctx->data_end;
-    data = (void *)(long)ctx->data;
+    return LB_NEXT_ENCAP;
+}
 
-    eth = data;
-    old_eth = data + sizeof(struct iphdr);
-    if ((void *)old_eth + sizeof(struct ethhdr) > data_end)
+SEC("xdp")
+int l4_lb_select_maglev(struct xdp_md *ctx) {
+    return next_stage(ctx, select_stage(ctx, LB_POLICY_MAGLEV));
+}
+
+SEC("xdp")
+int l4_lb_select_least_conn(struct xdp_md *ctx) {
+    return next_stage(ctx, select_stage(ctx, LB_POLICY_LEAST_CONN));
+}
+
+/* Stage 3: tunnel the packet to the selected backend with `udp_len` bytes of
+ * UDP/GUE header and send it out.
+ */
+static __always_inline int encap_stage(struct xdp_md *ctx, const int udp_len) {
+    struct lb_meta *meta = meta_get(ctx);
+    if (!meta)
         return XDP_ABORTED;
 
-    // switch dest and source of ethernet packet
-    memcpy(eth->h_source, old_eth->h_dest, sizeof(eth->h_source));
-    memcpy(eth->h_dest, old_eth->h_source, sizeof(eth->h_dest));
-    eth->h_proto = old_eth->h_proto;
+    __u32 backend_idx = meta->backend_idx;
+    __u32 hash = meta->hash;
+    __u64 now = meta->now;
+    int ipv6 = meta->flags & LB_META_IPV6;
 
-    struct iphdr *outer_iphdr;
-    outer_iphdr = data + sizeof(*eth);
-    iphdr = (void *)outer_iphdr + sizeof(*outer_iphdr);
+    // the metadata is not needed anymore, drop it instead of moving it along
+    if (bpf_xdp_adjust_meta(ctx, sizeof(struct lb_meta)) != 0)
+        return XDP_ABORTED;
 
-    if ((void *)eth + sizeof(struct ethhdr) > data_end ||
-        (void *)outer_iphdr + sizeof(struct iphdr) > data_end ||
-        (void *)iphdr + sizeof(struct iphdr) > data_end)
+    struct backend *backend = bpf_map_lookup_elem(&backend_map, &backend_idx);
+    if (!backend)
         return XDP_ABORTED;
 
-    outer_iphdr->version = 4;
-    outer_iphdr->ihl = iphdr->ihl;
-    outer_iphdr->frag_off = 0;
-    outer_iphdr->protocol = IPPROTO_IPIP;
-    outer_iphdr->check = 0;
-    outer_iphdr->tos = 0;
-    outer_iphdr->tot_len = bpf_htons(bpf_ntohs(iphdr->tot_len) + sizeof(*iphdr));
-    outer_iphdr->daddr = backend->ip;
-    outer_iphdr->saddr = iphdr->saddr;
-    outer_iphdr->ttl = iphdr->ttl;
+    /* Tell the client to send smaller packets if the encapsulated one doesn't
+     * fit the path to the backends. IPv4 packets without DF are sent anyway and
+     * fragmented on the way.
+     */
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    int ip_len = data_end - data - sizeof(struct ethhdr);
+    int encap_len = (ipv6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr)) + udp_len;
+    __u16 mtu = l4_lb_runtime.mtu;
 
-    iphdr->ttl -= 1;
+    if (mtu && ip_len + encap_len > mtu) {
+        if (ipv6)
+            return icmp6_too_big(ctx, mtu - encap_len);
 
-    ipv4_csum(outer_iphdr);
-    ipv4_csum(iphdr);
+        struct iphdr *iphdr = data + sizeof(struct ethhdr);
+        if ((void *)(iphdr + 1) > data_end)
+            return XDP_ABORTED;
+        if (iphdr->frag_off & bpf_htons(IP_DF))
+            return icmp4_too_big(ctx, mtu - encap_len);
+    }
 
-    bpf_printk("TX packet");
-    return XDP_TX;
+    struct nexthop *nh = backend_nexthop(ctx, backend_idx, backend, now);
+
+    // encapsulate packet in new ip packet
+    int action;
+    if (ipv6)
+        action = encap_ipv6(ctx, backend, nh, hash, udp_len);
+    else
+        action = encap_ipv4(ctx, backend, nh, hash, udp_len);
+
+    // the backend is reached through another interface
+    if (action == XDP_TX && nh && nh->ifindex != ctx->ingress_ifindex)
+        action = bpf_redirect_map(&tx_ports, nh->ifindex, XDP_DROP);
+    return action;
+}
+
+SEC("xdp")
+int l4_lb_encap_ipip(struct xdp_md *ctx) {
+    return encap_stage(ctx, 0);
+}
+
+SEC("xdp")
+int l4_lb_encap_fou(struct xdp_md *ctx) {
+    return encap_stage(ctx, sizeof(struct udphdr));
+}
+
+SEC("xdp")
+int l4_lb_encap_gue(struct xdp_md *ctx) {
+    return encap_stage(ctx, sizeof(struct udphdr) + sizeof(struct guehdr));
+}
+
+/* All stages in one program, attached instead of l4_lb when the NIC's RSS hash
+ * is used. Reading it needs a program bound to the device, and the kernel
+ * doesn't allow those to tail call, so policy and encapsulation are fixed when
+ * the program is loaded.
+ */
+SEC("xdp")
+int l4_lb_rx_hash(struct xdp_md *ctx) {
+    int ret = parse_stage(ctx, 1);
+
+    if (ret == LB_NEXT_SELECT)
+        ret = select_stage(ctx, l4_lb_cfg.policy);
+    if (ret == LB_NEXT_ENCAP) {
+        if (l4_lb_cfg.encap == LB_ENCAP_GUE)
+            ret = encap_stage(ctx, sizeof(struct udphdr) + sizeof(struct guehdr));
+        else if (l4_lb_cfg.encap == LB_ENCAP_FOU)
+            ret = encap_stage(ctx, sizeof(struct udphdr));
+        else
+            ret = encap_stage(ctx, 0);
+    }
+
+    return ret;
+}
+
+/* The benchmark runs these two on the same packet to measure a tail call */
+SEC("xdp")
+int l4_lb_bench_nop(struct xdp_md *ctx) {
+    return XDP_PASS;
+}
+
+SEC("xdp")
+int l4_lb_bench_tail_call(struct xdp_md *ctx) {
+    bpf_tail_call(ctx, &lb_stages, LB_STAGE_BENCH);
+    return XDP_ABORTED;
+}
+
+/* Compared to l4_lb_bench_nop this is what the RSS hash saves per packet */
+SEC("xdp")
+int l4_lb_bench_flow_hash(struct xdp_md *ctx) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct connection conn;
+
+    if (data + sizeof(conn) > data_end)
+        return XDP_ABORTED;
+
+    // hash whatever the packet starts with and store the result, so neither is optimized away
+    memcpy(&conn, data, sizeof(conn));
+    *(__u32 *)data = flow_hash(&conn);
 
-drop:
-    return XDP_DROP;
-pass:
     return XDP_PASS;
 }
 
+/* Insert a flow with a random client into `conntrack`, the benchmark runs this
+ * on many CPUs at once to measure how inserts scale
+ */
+static __always_inline int bench_conntrack_insert(void *conntrack, struct connection *conn) {
+    struct flow_state state = {
+        .last_seen = bpf_ktime_get_ns(),
+    };
+
+    if (!conntrack)
+        return XDP_ABORTED;
+
+    if (bpf_map_update_elem(conntrack, conn, &state, BPF_ANY) != 0)
+        return XDP_DROP;
+
+    return XDP_PASS;
+}
+
+static __always_inline void bench_random_flow(struct connection *conn) {
+    conn->src_addr = bpf_get_prandom_u32();
+    conn->dst_addr = bpf_htonl(0xc0000201); // 192.0.2.1
+    conn->src_port = bpf_get_prandom_u32();
+    conn->dst_port = bpf_htons(80);
+    conn->proto = IPPROTO_TCP;
+}
+
+SEC("xdp")
+int l4_lb_bench_ct_sharded(struct xdp_md *ctx) {
+    struct connection conn = {};
+
+    bench_random_flow(&conn);
+    return bench_conntrack_insert(conntrack_shard(&conn), &conn);
+}
+
+SEC("xdp")
+int l4_lb_bench_ct_single(struct xdp_md *ctx) {
+    struct connection conn = {};
+
+    bench_random_flow(&conn);
+    return bench_conntrack_insert(&bench_conntrack, &conn);
+}
+
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
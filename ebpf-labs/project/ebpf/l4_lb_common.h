@@ -0,0 +1,210 @@
+#ifndef L4_LB_COMMON_H_
+#define L4_LB_COMMON_H_
+
+/* Types shared between the XDP program and the l4_lb control plane. Only use
+ * fixed-size kernel types here so that both sides agree on the layout.
+ */
+
+#include <linux/types.h>
+
+#define DEFAULT_CONNTRACK_MAX_FLOWS (1 << 20)
+#define DEFAULT_CONNTRACK_IDLE_TIMEOUT_MS 30000
+#define DEFAULT_CONNTRACK_CLOSING_TIMEOUT_MS 10000
+/* The connection table is split into this many maps, each with its own locks
+ * and LRU lists, so that CPUs inserting new flows at once rarely contend
+ */
+#define CONNTRACK_SHARD_BITS 4
+#define CONNTRACK_SHARDS (1 << CONNTRACK_SHARD_BITS)
+
+#define MAX_SERVICES 1024
+#define MAX_BACKENDS 1024
+
+/* Number of slots of the Maglev lookup table, has to be a prime. Every
+ * service has MAGLEV_RING_COPIES rings of this size in maglev_map.
+ */
+#define MAGLEV_TABLE_SIZE 65537
+/* The control plane writes a new ring into the copy the data plane is not
+ * using and then flips the generation of the service.
+ */
+#define MAGLEV_RING_COPIES 2
+/* Marks a Maglev slot that is not assigned to any backend */
+#define MAGLEV_NO_BACKEND 0xffffffff
+#define FLOW_HASH_SEED 0x2d31e867
+
+/* Outer headers the IPv4 encapsulation puts in front of the packet: Ethernet
+ * (14 bytes) and IPv4 (20 bytes), kept as 16 bit words because the packet is
+ * only 2 byte aligned behind the Ethernet header.
+ */
+#define ENCAP_ETH_WORDS 7
+#define ENCAP_IPV4_WORDS 17
+#define ENCAP_TTL 64
+#define DEFAULT_FOU_PORT 5555
+#define DEFAULT_GUE_PORT 6080
+
+/* How packets are tunneled to the backends */
+enum lb_encap {
+    LB_ENCAP_IPIP, /* IPIP or IP6IP6 */
+    LB_ENCAP_FOU,  /* IP in UDP, the source port carries the flow hash for RSS */
+    LB_ENCAP_GUE,  /* IP in GUE (a UDP header plus the inner protocol) */
+};
+
+/* Generic UDP Encapsulation header, variant 0 without optional fields */
+struct guehdr {
+    __u8 hlen_ver; /* version, control flag and length of the optional fields, all 0 */
+    __u8 proto_ctype;
+    __be16 flags;
+};
+
+/* Slots of the lb_stages program array */
+enum lb_stage {
+    LB_STAGE_SELECT, /* l4_lb_select_*: conntrack and backend selection */
+    LB_STAGE_ENCAP,  /* l4_lb_encap_*: encapsulation and transmission */
+    LB_STAGE_BENCH,  /* l4_lb_bench_nop, installed by --bench for the tail call benchmark */
+    LB_STAGE_MAX,
+};
+
+/* How a new flow is assigned to a backend */
+enum lb_policy {
+    LB_POLICY_MAGLEV,     /* consistent hashing through the Maglev table */
+    LB_POLICY_LEAST_CONN, /* the less loaded of two random backends by active connections */
+};
+
+/* Key of services_map. A port of 0 matches every port of the VIP for which
+ * there is no more specific service.
+ */
+struct service_key {
+    union {
+        __be32 vip;
+        __be32 vip6[4];
+    };
+    __be16 port;
+    __u8 proto;
+    __u8 ipv6;
+};
+
+/* Value of services_map */
+struct service {
+    __u32 ring; /* index of the service's Maglev rings in maglev_map */
+    __u32 gen;  /* bumped on every ring update, the low bit selects the ring copy */
+    /* Token bucket of every client of the service: a token is added every
+     * rate_interval_ns and the bucket holds rate_burst_ns worth of them. An
+     * interval of 0 doesn't limit the clients.
+     */
+    __u64 rate_interval_ns;
+    __u64 rate_burst_ns;
+};
+
+/* This is the data record stored in backend_map. It is written by the control
+ * plane only, the data plane never modifies it.
+ */
+struct backend {
+    union {
+        __be32 ip;
+        __be32 ip6[4];
+    };
+    __u8 ipv6;        /* the backend is reached through an IPv6 tunnel */
+    __u8 up;          /* the slot holds a backend, flows of a slot that is not up are reassigned */
+    __u8 reflect_mac; /* no next hop MAC is known, send packets back to where they came from */
+    __u8 pad;
+    /* Unfolded checksum of the outer IPv4 header of encap, which leaves the
+     * protocol, tot_len, saddr and check zeroed for encap_ipv4() to fill in.
+     */
+    __u32 csum_partial;
+    __u64 score;     /* active connections, aggregated and published by the control plane */
+    __u32 max_conns; /* score at which the backend takes no new flows, 0 for no cap */
+    /* Outer Ethernet and IPv4 header, IPv6 backends only use the Ethernet part */
+    __u16 encap[ENCAP_IPV4_WORDS];
+};
+
+/* Where packets to a backend leave the load balancer, as resolved by the data
+ * plane through bpf_fib_lookup() and cached per CPU in nexthop_cache.
+ */
+struct nexthop {
+    __u16 mac[6];      /* destination and source MAC, as in the Ethernet header */
+    __u32 ifindex;     /* egress interface, 0 if the lookup failed */
+    __be32 daddr[4];   /* backend the entry was resolved for */
+    __u64 expires;     /* bpf_ktime_get_ns() after which the entry is looked up again */
+};
+
+/* Per-CPU counters of a backend in backend_stats, summed up by the control plane */
+struct backend_stats {
+    __u64 num_flows; /* flows ever assigned to the backend */
+    __u64 num_packets;
+    __s64 active_flows; /* opened minus closed flows on this CPU, may be negative */
+};
+
+/* Key of the connection tracking table, IPv4 flows only use the first word of
+ * the addresses and leave the rest zeroed.
+ */
+struct connection {
+    union {
+        __be32 dst_addr;
+        __be32 dst_addr6[4];
+    };
+    union {
+        __be32 src_addr;
+        __be32 src_addr6[4];
+    };
+    __be16 dst_port;
+    __be16 src_port;
+    __u8 proto;
+    __u8 ipv6;
+    __u8 pad[2];
+};
+
+enum flow_state_type {
+    FLOW_STATE_ACTIVE,
+    FLOW_STATE_CLOSING, /* a TCP FIN was seen, the flow expires after the closing timeout */
+};
+
+/* Value of the connection tracking table */
+struct flow_state {
+    __u32 backend_idx;
+    __u8 state;  /* enum flow_state_type */
+    __u8 logged; /* sampled for the flow log, its end is logged as well */
+    __u8 pad[2];
+    __u64 last_seen; /* bpf_ktime_get_ns() of the last packet of the flow */
+};
+
+enum flow_event_type {
+    FLOW_EVENT_NEW,        /* a flow was assigned to a backend */
+    FLOW_EVENT_CLOSED,     /* a TCP flow ended with a FIN or RST */
+    FLOW_EVENT_EXPIRED,    /* a flow was idle for longer than its timeout */
+    FLOW_EVENT_REASSIGNED, /* the backend of a flow went away, it moves to another one */
+};
+
+/* Record of the flow_events ring buffer, emitted for the flows the flow log
+ * samples
+ */
+struct flow_event {
+    __u64 timestamp_ns; /* bpf_ktime_get_ns() */
+    struct connection conn;
+    __u32 backend_idx;
+    __u8 type; /* enum flow_event_type */
+    __u8 pad[3];
+};
+
+/* Index into the per-CPU lb_stats array */
+enum lb_stat {
+    LB_STAT_FLOWS_CREATED,    /* a new conntrack entry was inserted */
+    LB_STAT_FLOWS_EXPIRED,    /* an idle conntrack entry was found and reassigned */
+    LB_STAT_CONNTRACK_FULL,   /* inserting a new conntrack entry failed */
+    LB_STAT_FLOWS_CLOSED,     /* a TCP flow was closed by a FIN or RST */
+    LB_STAT_FLOWS_RESET,      /* a TCP flow was removed from the table because of a RST */
+    LB_STAT_TCP_NO_STATE,     /* a TCP packet without SYN did not match any flow */
+    LB_STAT_FLOWS_REASSIGNED, /* a flow's backend was removed and it had to move */
+    LB_STAT_FIB_FAILED,       /* no route or neighbour towards a backend, the template MACs were used */
+    LB_STAT_TAIL_CALL_FAILED, /* a stage of the pipeline is missing or the metadata didn't fit */
+    LB_STAT_FRAGMENTS,        /* a non-first IPv4 fragment followed the first one of its datagram */
+    LB_STAT_FRAG_UNKNOWN,     /* a non-first IPv4 fragment without a known first one was passed */
+    LB_STAT_ICMP_TOO_BIG,     /* a packet didn't fit the MTU once encapsulated, the client was told */
+    LB_STAT_RX_HASH_MISSING,  /* the NIC had no L4 hash for a packet, it was hashed in software */
+    LB_STAT_SYN_CHALLENGED,   /* a SYN of an unverified client was answered with a SYN cookie */
+    LB_STAT_SYN_VERIFIED,     /* a client answered a SYN cookie and is trusted from now on */
+    LB_STAT_BACKEND_FULL,     /* a new flow was dropped, the backends tried were at their cap */
+    LB_STAT_FLOW_EVENTS_LOST, /* a flow event didn't fit into the ring buffer */
+    LB_STAT_ENCAP_FAILED,     /* no headroom for the outer headers, the packet was dropped */
+    LB_STAT_MAX,
+};
+
+#endif // L4_LB_COMMON_H_
@@ -0,0 +1,36 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <errno.h>
+#include <linux/types.h>
+#include <sys/epoll.h>
+
+/* Something the main loop of l4_lb waits for. Its address is the data of the
+ * epoll event, `handle` is called with `ctx` and the events that occurred.
+ */
+struct event_source {
+    void (*handle)(void *ctx, __u32 events);
+    void *ctx;
+};
+
+/* Wait for `events` on `fd` and hand them to `src` */
+static inline int event_loop_add(int epoll_fd, int fd, __u32 events, struct event_source *src) {
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = src,
+    };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) ? -errno : 0;
+}
+
+/* Wait for `events` on `fd` from now on, instead of what it was added with */
+static inline int event_loop_modify(int epoll_fd, int fd, __u32 events, struct event_source *src) {
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = src,
+    };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) ? -errno : 0;
+}
+
+#endif // EVENT_LOOP_H_
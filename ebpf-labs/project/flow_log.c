@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flow_log.h"
+#include "lb_state.h"
+#include "log.h"
+
+static __u64 clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void flow_log_add(struct flow_log *fl, const struct flow_event *ev) {
+    struct flow_log_record rec = {
+        .time_ns = ev->timestamp_ns + fl->realtime_offset_ns,
+        .conn = ev->conn,
+        .backend_idx = ev->backend_idx,
+        .type = ev->type,
+    };
+
+    if (!fl->file)
+        return;
+
+    if (ev->backend_idx < MAX_BACKENDS)
+        memcpy(rec.backend, fl->st->backends[ev->backend_idx].be.ip6, sizeof(rec.backend));
+
+    if (fwrite(&rec, sizeof(rec), 1, fl->file) == 1)
+        fl->written++;
+}
+
+static int flow_log_event(void *ctx, void *data, size_t size) {
+    if (size >= sizeof(struct flow_event))
+        flow_log_add(ctx, data);
+    return 0;
+}
+
+static void flow_log_ready(void *ctx, __u32 events) {
+    struct flow_log *fl = ctx;
+
+    if (ring_buffer__consume(fl->rb) < 0)
+        log_error("Failed to read the flow events: %s", strerror(errno));
+}
+
+int flow_log_init(struct flow_log *fl, struct lb_state *st, int epoll_fd) {
+    int err;
+
+    memset(fl, 0, sizeof(*fl));
+    fl->st = st;
+    fl->src = (struct event_source){.handle = flow_log_ready, .ctx = fl};
+    // the data plane stamps the events with the monotonic clock
+    fl->realtime_offset_ns = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+    fl->rb = ring_buffer__new(bpf_map__fd(st->skel->maps.flow_events), flow_log_event, fl, NULL);
+    if (!fl->rb)
+        return -errno;
+
+    err = event_loop_add(epoll_fd, ring_buffer__epoll_fd(fl->rb), EPOLLIN, &fl->src);
+    if (err)
+        flow_log_free(fl);
+    return err;
+}
+
+void flow_log_free(struct flow_log *fl) {
+    flow_log_set_path(fl, NULL);
+    ring_buffer__free(fl->rb);
+    fl->rb = NULL;
+}
+
+/* Check the header of an existing flow log, or write it into an empty one */
+static int flow_log_header(FILE *file, const char *path) {
+    struct flow_log_header hdr = {
+        .version = FLOW_LOG_VERSION,
+        .record_size = sizeof(struct flow_log_record),
+    };
+    struct flow_log_header found;
+
+    memcpy(hdr.magic, FLOW_LOG_MAGIC, sizeof(hdr.magic));
+    if (fseek(file, 0, SEEK_END))
+        return -errno;
+
+    long size = ftell(file);
+    if (size < 0)
+        return -errno;
+    if (size == 0)
+        return fwrite(&hdr, sizeof(hdr), 1, file) == 1 ? 0 : -EIO;
+
+    rewind(file);
+    if (fread(&found, sizeof(found), 1, file) != 1 || memcmp(&found, &hdr, sizeof(hdr))) {
+        log_error("%s is not a flow log of this version of l4_lb", path);
+        return -EINVAL;
+    }
+
+    // in append mode the records go to the end anyway
+    return 0;
+}
+
+int flow_log_set_path(struct flow_log *fl, const char *path) {
+    if (fl->path && path && !strcmp(fl->path, path))
+        return 0;
+
+    if (fl->file) {
+        flow_log_flush(fl);
+        fclose(fl->file);
+        log_info("Closed the flow log %s after %llu records", fl->path, fl->written);
+    }
+    free(fl->path);
+    fl->file = NULL;
+    fl->path = NULL;
+    fl->written = 0;
+
+    if (!path)
+        return 0;
+
+    FILE *file = fopen(path, "a+b");
+    if (!file) {
+        int err = -errno;
+
+        log_error("Failed to open the flow log %s: %s", path, strerror(errno));
+        return err;
+    }
+
+    int err = flow_log_header(file, path);
+    if (err) {
+        fclose(file);
+        return err;
+    }
+
+    fl->file = file;
+    fl->path = strdup(path);
+    log_info("Writing the flow log to %s", path);
+    return 0;
+}
+
+void flow_log_flush(struct flow_log *fl) {
+    if (fl->rb && ring_buffer__consume(fl->rb) < 0)
+        log_error("Failed to read the flow events: %s", strerror(errno));
+    if (fl->file)
+        fflush(fl->file);
+}
@@ -0,0 +1,64 @@
+#ifndef FLOW_LOG_H_
+#define FLOW_LOG_H_
+
+#include <stdio.h>
+
+#include "ebpf/l4_lb_common.h"
+#include "event_loop.h"
+
+#define FLOW_LOG_MAGIC "L4LBFLOW"
+#define FLOW_LOG_VERSION 1
+
+/* A flow log starts with this header, followed by flow_log_record entries in
+ * the byte order of the machine that wrote them
+ */
+struct flow_log_header {
+    char magic[8];
+    __u32 version;
+    __u32 record_size;
+};
+
+/* A flow event as written to the flow log */
+struct flow_log_record {
+    __u64 time_ns; /* wall clock time, ns since the epoch */
+    struct connection conn;
+    __be32 backend[4]; /* address of the backend, of the family of the VIP */
+    __u32 backend_idx;
+    __u8 type; /* enum flow_event_type */
+    __u8 pad[3];
+};
+
+struct lb_state;
+struct ring_buffer;
+
+/* Reads the events of the flow_events ring buffer from the main loop and
+ * appends them to a file
+ */
+struct flow_log {
+    struct lb_state *st;
+    struct ring_buffer *rb;
+    struct event_source src;
+    FILE *file;
+    char *path;
+    __s64 realtime_offset_ns; /* wall clock minus monotonic clock */
+    __u64 written;            /* records written so far */
+};
+
+int flow_log_init(struct flow_log *fl, struct lb_state *st, int epoll_fd);
+void flow_log_free(struct flow_log *fl);
+
+/* Append the records to the flow log at `path` from now on, creating it if
+ * needed. NULL stops writing, events are then read and dropped.
+ */
+int flow_log_set_path(struct flow_log *fl, const char *path);
+
+/* Write the events waiting in the ring buffer and flush the file. The data
+ * plane only wakes the main loop up for larger batches, so call it
+ * periodically.
+ */
+void flow_log_flush(struct flow_log *fl);
+
+/* Log an event the control plane saw itself, e.g. a flow it swept */
+void flow_log_add(struct flow_log *fl, const struct flow_event *ev);
+
+#endif // FLOW_LOG_H_
@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "health.h"
+#include "log.h"
+
+/* What UDP probes send, any answer counts as success */
+#define UDP_PROBE_PAYLOAD "l4_lb health check"
+
+struct health_probe {
+    struct event_source src;
+    struct health_checker *hc;
+    __u32 idx;         /* backend slot */
+    __u8 active;       /* the slot holds a configured backend that is checked */
+    __u8 healthy;      /* as last told to lb_state */
+    __u8 pending;      /* a probe is in flight */
+    int fd;            /* socket of the TCP or UDP probe in flight, -1 for none */
+    __u32 round;       /* number of the probe, echo replies carry it */
+    __u64 next_ns;     /* when the next probe is due */
+    __u64 deadline_ns; /* when the probe in flight fails */
+    __u32 successes;   /* probes in a row that succeeded */
+    __u32 failures;    /* probes in a row that failed */
+};
+
+/* ICMP and ICMPv6 echo request and reply, the sequence number is the backend
+ * slot of the probe
+ */
+struct echo {
+    __u8 type;
+    __u8 code;
+    __u16 checksum;
+    __be16 id;
+    __be16 seq;
+    __u32 round;
+};
+
+static __u64 monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static socklen_t backend_sockaddr(const struct backend *be, __u16 port,
+                                  struct sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(*addr));
+
+    if (be->ipv6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, be->ip6, sizeof(sin6->sin6_addr));
+        return sizeof(*sin6);
+    }
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = be->ip;
+    return sizeof(*sin);
+}
+
+static int backend_is_sender(const struct backend *be, const struct sockaddr_storage *addr) {
+    if (be->ipv6)
+        return addr->ss_family == AF_INET6 &&
+               !memcmp(&((const struct sockaddr_in6 *)addr)->sin6_addr, be->ip6, sizeof(be->ip6));
+
+    return addr->ss_family == AF_INET &&
+           ((const struct sockaddr_in *)addr)->sin_addr.s_addr == be->ip;
+}
+
+/* Internet checksum of an ICMP message, ICMPv6 checksums are filled in by the
+ * kernel
+ */
+static __u16 icmp_checksum(const void *data, size_t len) {
+    const __u16 *words = data;
+    __u32 sum = 0;
+
+    for (size_t i = 0; i < len / 2; i++)
+        sum += words[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/* Fire the timer at `at_ns` on the monotonic clock, UINT64_MAX stops it */
+static void timer_arm(struct health_checker *hc, __u64 at_ns) {
+    struct itimerspec its = {};
+
+    if (at_ns != UINT64_MAX) {
+        its.it_value.tv_sec = at_ns / 1000000000ULL;
+        its.it_value.tv_nsec = at_ns % 1000000000ULL;
+    }
+
+    if (timerfd_settime(hc->timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+        log_error("Failed to arm the health check timer: %s", strerror(errno));
+}
+
+/* Drop the probe in flight without a result */
+static void probe_cancel(struct health_probe *p) {
+    // closing the socket also takes it out of the epoll
+    if (p->fd >= 0)
+        close(p->fd);
+    p->fd = -1;
+    p->pending = 0;
+}
+
+/* Count the result of the probe in flight and tell lb_state once the backend
+ * failed or passed enough probes in a row
+ */
+static void probe_finish(struct health_probe *p, bool ok) {
+    struct health_checker *hc = p->hc;
+
+    probe_cancel(p);
+    if (ok) {
+        p->successes++;
+        p->failures = 0;
+    } else {
+        p->failures++;
+        p->successes = 0;
+        log_debug("Health check %u of backend slot %u failed", p->failures, p->idx);
+    }
+
+    if (p->healthy ? p->failures < hc->conf.fall : p->successes < hc->conf.rise)
+        return;
+
+    p->healthy = !p->healthy;
+    if (lb_state_set_backend_health(hc->st, p->idx, p->healthy))
+        log_error("Error while marking backend slot %u %s", p->idx, p->healthy ? "up" : "down");
+}
+
+static void probe_start(struct health_checker *hc, struct health_probe *p, __u64 now) {
+    const struct backend *be = &hc->st->backends[p->idx].be;
+    int family = be->ipv6 ? AF_INET6 : AF_INET;
+    int udp = hc->conf.proto == HEALTH_UDP;
+    struct sockaddr_storage addr;
+    socklen_t len;
+
+    p->pending = 1;
+    p->round++;
+    p->deadline_ns = now + hc->conf.timeout_ms * 1000000ULL;
+
+    if (hc->conf.proto == HEALTH_ICMP) {
+        struct echo echo = {
+            .type = be->ipv6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO,
+            .id = htons(hc->echo_id),
+            .seq = htons(p->idx),
+            .round = p->round,
+        };
+
+        if (!be->ipv6)
+            echo.checksum = icmp_checksum(&echo, sizeof(echo));
+
+        // raw sockets take no port
+        len = backend_sockaddr(be, 0, &addr);
+        if (sendto(hc->icmp_fds[be->ipv6], &echo, sizeof(echo), 0, (struct sockaddr *)&addr,
+                   len) == sizeof(echo))
+            return;
+    } else {
+        len = backend_sockaddr(be, hc->conf.port, &addr);
+        p->fd = socket(family, (udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (p->fd >= 0) {
+            /* Close TCP probes with a RST, so that probing thousands of
+             * backends doesn't fill up TIME_WAIT
+             */
+            struct linger linger = {.l_onoff = 1};
+
+            if (!udp)
+                setsockopt(p->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+            if ((!connect(p->fd, (struct sockaddr *)&addr, len) || errno == EINPROGRESS) &&
+                (!udp || send(p->fd, UDP_PROBE_PAYLOAD, sizeof(UDP_PROBE_PAYLOAD) - 1, 0) >= 0) &&
+                !event_loop_add(hc->epoll_fd, p->fd, udp ? EPOLLIN : EPOLLOUT, &p->src))
+                return;
+        }
+    }
+
+    // no route, no socket left, ...
+    probe_finish(p, false);
+}
+
+/* A TCP probe connected or failed to, or a UDP probe got an answer or an ICMP
+ * error
+ */
+static void probe_event(void *ctx, __u32 events) {
+    struct health_probe *p = ctx;
+    char buf[64];
+
+    // the probe timed out while the event was waiting in the same batch
+    if (!p->pending || p->fd < 0)
+        return;
+
+    if (p->hc->conf.proto == HEALTH_TCP) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+            err = errno;
+        probe_finish(p, err == 0);
+        return;
+    }
+
+    if (recv(p->fd, buf, sizeof(buf), 0) >= 0)
+        probe_finish(p, true);
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        probe_finish(p, false);
+}
+
+/* Match the echo replies waiting on a shared ICMP socket to their probes */
+static void icmp_receive(struct health_checker *hc, int ipv6) {
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    __u8 buf[1500];
+    ssize_t n;
+
+    while ((n = recvfrom(hc->icmp_fds[ipv6], buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                         &from_len)) >= 0) {
+        const __u8 *msg = buf;
+        struct echo echo;
+
+        from_len = sizeof(from);
+
+        // raw IPv4 sockets deliver the IP header as well
+        if (!ipv6) {
+            size_t hdr_len = ((const struct iphdr *)buf)->ihl * 4;
+
+            if (n < sizeof(struct iphdr) || n < hdr_len)
+                continue;
+            msg += hdr_len;
+            n -= hdr_len;
+        }
+
+        if (n < sizeof(echo))
+            continue;
+        memcpy(&echo, msg, sizeof(echo));
+
+        // the socket sees the replies to everyone's echo requests
+        if (echo.type != (ipv6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY) ||
+            ntohs(echo.id) != hc->echo_id || ntohs(echo.seq) >= MAX_BACKENDS)
+            continue;
+
+        struct health_probe *p = &hc->probes[ntohs(echo.seq)];
+        if (p->active && p->pending && echo.round == p->round &&
+            backend_is_sender(&hc->st->backends[p->idx].be, &from))
+            probe_finish(p, true);
+    }
+}
+
+static void icmp4_event(void *ctx, __u32 events) {
+    icmp_receive(ctx, 0);
+}
+
+static void icmp6_event(void *ctx, __u32 events) {
+    icmp_receive(ctx, 1);
+}
+
+static void icmp_close(struct health_checker *hc) {
+    for (int i = 0; i < 2; i++) {
+        if (hc->icmp_fds[i] >= 0)
+            close(hc->icmp_fds[i]);
+        hc->icmp_fds[i] = -1;
+    }
+}
+
+/* Open the raw sockets of the echo probes. Probes of a family whose socket
+ * can't be opened fail.
+ */
+static void icmp_open(struct health_checker *hc) {
+    struct icmp6_filter filter;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (fd < 0 || event_loop_add(hc->epoll_fd, fd, EPOLLIN, &hc->icmp[0]))
+        log_error("Failed to open the socket of the ICMP health checks: %s", strerror(errno));
+    hc->icmp_fds[0] = fd;
+
+    fd = socket(AF_INET6, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMPV6);
+    if (fd < 0 || event_loop_add(hc->epoll_fd, fd, EPOLLIN, &hc->icmp[1])) {
+        log_error("Failed to open the socket of the ICMPv6 health checks: %s", strerror(errno));
+    } else {
+        // only wake up for echo replies
+        ICMP6_FILTER_SETBLOCKALL(&filter);
+        ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+        setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+    }
+    hc->icmp_fds[1] = fd;
+}
+
+/* Time out the probes that are late, start the ones that are due and set the
+ * timer to the next of either
+ */
+static void health_run(struct health_checker *hc) {
+    __u64 interval_ns = hc->conf.interval_ms * 1000000ULL;
+    __u64 now = monotonic_ns();
+    __u64 next = UINT64_MAX;
+
+    for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+        struct health_probe *p = &hc->probes[i];
+
+        if (!p->active)
+            continue;
+
+        /* A probe that timed out starts again with the next run at the
+         * earliest, by then epoll has no events left for its old socket.
+         */
+        if (p->pending && now >= p->deadline_ns) {
+            probe_finish(p, false);
+        } else if (!p->pending && now >= p->next_ns) {
+            // keep the schedule, so that the probes stay spread over the interval
+            p->next_ns += interval_ns;
+            if (p->next_ns <= now)
+                p->next_ns = now + interval_ns;
+            probe_start(hc, p, now);
+        }
+
+        if (p->pending && p->deadline_ns < next)
+            next = p->deadline_ns;
+        if (p->next_ns < next)
+            next = p->next_ns;
+    }
+
+    timer_arm(hc, next);
+}
+
+static void health_timer(void *ctx, __u32 events) {
+    struct health_checker *hc = ctx;
+    __u64 expirations;
+
+    if (read(hc->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        log_error("Failed to read the health check timer: %s", strerror(errno));
+
+    health_run(hc);
+}
+
+int health_init(struct health_checker *hc, struct lb_state *st, int epoll_fd) {
+    int err;
+
+    memset(hc, 0, sizeof(*hc));
+    hc->st = st;
+    hc->epoll_fd = epoll_fd;
+    hc->icmp_fds[0] = hc->icmp_fds[1] = -1;
+    hc->echo_id = getpid() & 0xffff;
+    hc->timer = (struct event_source){.handle = health_timer, .ctx = hc};
+    hc->icmp[0] = (struct event_source){.handle = icmp4_event, .ctx = hc};
+    hc->icmp[1] = (struct event_source){.handle = icmp6_event, .ctx = hc};
+
+    hc->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    hc->probes = calloc(MAX_BACKENDS, sizeof(*hc->probes));
+    if (hc->timer_fd < 0 || !hc->probes) {
+        err = hc->timer_fd < 0 ? -errno : -ENOMEM;
+        health_free(hc);
+        return err;
+    }
+
+    for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+        struct health_probe *p = &hc->probes[i];
+
+        p->src = (struct event_source){.handle = probe_event, .ctx = p};
+        p->hc = hc;
+        p->idx = i;
+        p->fd = -1;
+    }
+
+    err = event_loop_add(epoll_fd, hc->timer_fd, EPOLLIN, &hc->timer);
+    if (err)
+        health_free(hc);
+    return err;
+}
+
+void health_free(struct health_checker *hc) {
+    for (__u32 i = 0; hc->probes && i < MAX_BACKENDS; i++)
+        probe_cancel(&hc->probes[i]);
+    free(hc->probes);
+    hc->probes = NULL;
+
+    icmp_close(hc);
+    if (hc->timer_fd >= 0)
+        close(hc->timer_fd);
+    hc->timer_fd = -1;
+}
+
+void health_configure(struct health_checker *hc, const struct health_conf *conf) {
+    if (conf->proto != hc->conf.proto || conf->port != hc->conf.port) {
+        // health_sync() starts over with the new probes
+        for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+            probe_cancel(&hc->probes[i]);
+            hc->probes[i].active = 0;
+        }
+
+        icmp_close(hc);
+        if (conf->proto == HEALTH_ICMP)
+            icmp_open(hc);
+    }
+
+    hc->conf = *conf;
+
+    // nothing checks the backends anymore, so nothing may keep them down
+    for (__u32 i = 0; conf->proto == HEALTH_NONE && i < MAX_BACKENDS; i++) {
+        if (lb_state_set_backend_health(hc->st, i, true))
+            log_error("Error while marking backend slot %u up", i);
+    }
+
+    health_sync(hc);
+}
+
+void health_sync(struct health_checker *hc) {
+    __u64 interval_ns = hc->conf.interval_ms * 1000000ULL;
+    __u64 now = monotonic_ns();
+
+    for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+        const struct lb_backend_slot *b = &hc->st->backends[i];
+        struct health_probe *p = &hc->probes[i];
+        __u8 checked = hc->conf.proto != HEALTH_NONE && b->in_use && !b->draining;
+
+        if (checked == p->active)
+            continue;
+
+        probe_cancel(p);
+        p->active = checked;
+        if (!checked)
+            continue;
+
+        // backends start out as they are, adopted ones may be down already
+        p->healthy = !b->unhealthy;
+        p->successes = 0;
+        p->failures = 0;
+        // spread the probes of all backends over the interval
+        p->next_ns = now + interval_ns * i / MAX_BACKENDS;
+    }
+
+    health_run(hc);
+}
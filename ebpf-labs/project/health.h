@@ -0,0 +1,56 @@
+#ifndef HEALTH_H_
+#define HEALTH_H_
+
+#include "event_loop.h"
+#include "lb_state.h"
+
+enum health_proto {
+    HEALTH_NONE, /* backends are never checked and always up */
+    HEALTH_TCP,  /* a backend is up if it accepts a connection to the port */
+    HEALTH_UDP,  /* a backend is up if it answers a datagram sent to the port */
+    HEALTH_ICMP, /* a backend is up if it answers an echo request */
+};
+
+/* How the backends are checked */
+struct health_conf {
+    enum health_proto proto;
+    __u16 port;        /* destination port of TCP and UDP probes */
+    __u32 interval_ms; /* time between two probes of a backend */
+    __u32 timeout_ms;  /* time a backend has to answer, at most interval_ms */
+    __u32 fall;        /* failed probes in a row that take a backend down */
+    __u32 rise;        /* successful probes in a row that bring it back */
+};
+
+struct health_probe;
+
+/* Probes every configured backend on its own schedule. All probes are
+ * non-blocking sockets on the epoll of the main loop, driven by a single
+ * timerfd that fires at the next probe or timeout that is due.
+ */
+struct health_checker {
+    struct lb_state *st;
+    struct health_conf conf;
+    int epoll_fd;
+    int timer_fd;
+    struct event_source timer;
+    int icmp_fds[2]; /* raw ICMP and ICMPv6 sockets shared by all echo probes */
+    struct event_source icmp[2];
+    __u16 echo_id;               /* identifier of our echo requests */
+    struct health_probe *probes; /* one per backend slot */
+};
+
+int health_init(struct health_checker *hc, struct lb_state *st, int epoll_fd);
+void health_free(struct health_checker *hc);
+
+/* Check the backends as `conf` says from now on. Probes in flight are
+ * dropped if the protocol or port changed. HEALTH_NONE brings all backends
+ * that are down back up.
+ */
+void health_configure(struct health_checker *hc, const struct health_conf *conf);
+
+/* Start checking backends the config added and stop checking removed ones.
+ * Call after lb_state_apply().
+ */
+void health_sync(struct health_checker *hc);
+
+#endif // HEALTH_H_
@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <linux/if_link.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <argparse.h>
+#include <net/if.h>
+
+#include <cyaml/cyaml.h>
+
+#include "ebpf/l4_decap_common.h"
+#include "l4_decap.skel.h"
+
+#ifndef __USE_POSIX
+#define __USE_POSIX
+#endif
+#include <signal.h>
+
+#include "log.h"
+
+/* How often the decapsulation counters are reported */
+#define REPORT_INTERVAL_S 5
+
+static const char *const usages[] = {
+    "l4_decap [options] [[--] args]",
+    "l4_decap [options]",
+    NULL,
+};
+
+/* The part of the l4_lb config the backends need, everything else is ignored */
+struct service_yaml {
+    char *vip;
+};
+
+struct config {
+    enum lb_encap encap;
+    uint16_t encap_port;
+    struct service_yaml *services;
+    size_t services_count;
+};
+
+static const cyaml_schema_field_t service_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("vip", CYAML_FLAG_POINTER, struct service_yaml, vip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_schema_value_t service_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct service_yaml, service_field_schema),
+};
+
+static const cyaml_strval_t encap_strings[] = {
+    {"ipip", LB_ENCAP_IPIP},
+    {"fou", LB_ENCAP_FOU},
+    {"gue", LB_ENCAP_GUE},
+};
+
+static const cyaml_schema_field_t top_mapping_schema[] = {
+    CYAML_FIELD_ENUM("encap", CYAML_FLAG_OPTIONAL, struct config, encap, encap_strings,
+                     CYAML_ARRAY_LEN(encap_strings)),
+    CYAML_FIELD_UINT("encap_port", CYAML_FLAG_OPTIONAL, struct config, encap_port),
+    CYAML_FIELD_SEQUENCE("services", CYAML_FLAG_POINTER, struct config, services, &service_schema,
+                         1, DECAP_MAX_VIPS),
+    CYAML_FIELD_END};
+
+static const cyaml_schema_value_t config_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_POINTER, struct config, top_mapping_schema),
+};
+
+static const cyaml_config_t config = {
+    .log_fn = cyaml_log,
+    .mem_fn = cyaml_mem,
+    .log_level = CYAML_LOG_WARNING,
+    .flags = CYAML_CFG_IGNORE_UNKNOWN_KEYS, /* the same file configures l4_lb */
+};
+
+static int ifindex_iface = 0;
+static __u32 xdp_flags = 0;
+
+static void cleanup_ifaces() {
+    __u32 curr_prog_id = 0;
+
+    if (ifindex_iface != 0) {
+        if (!bpf_xdp_query_id(ifindex_iface, xdp_flags, &curr_prog_id)) {
+            if (curr_prog_id) {
+                bpf_xdp_detach(ifindex_iface, xdp_flags, NULL);
+                log_trace("Detached XDP program from interface %d", ifindex_iface);
+            }
+        }
+    }
+}
+
+static __u64 read_decap_stat(int stats_fd, __u32 stat) {
+    int ncpus = libbpf_num_possible_cpus();
+    __u64 values[ncpus];
+    __u64 sum = 0;
+
+    if (ncpus <= 0 || bpf_map_lookup_elem(stats_fd, &stat, values))
+        return 0;
+
+    for (int i = 0; i < ncpus; i++)
+        sum += values[i];
+
+    return sum;
+}
+
+/* Put the VIPs of all services into the vips map, services sharing a VIP
+ * just write the same key again.
+ */
+static int load_vips(struct l4_decap_bpf *skel, const struct config *conf) {
+    int vips_fd = bpf_map__fd(skel->maps.vips);
+    __u8 one = 1;
+
+    for (size_t i = 0; i < conf->services_count; i++) {
+        const char *addr = conf->services[i].vip;
+        struct decap_vip vip = {};
+
+        if (inet_pton(AF_INET6, addr, vip.vip6) == 1) {
+            vip.ipv6 = 1;
+        } else if (inet_pton(AF_INET, addr, &vip.vip) != 1) {
+            log_error("Failed to convert VIP %s to an IPv4 or IPv6 address", addr);
+            return -1;
+        }
+
+        if (bpf_map_update_elem(vips_fd, &vip, &one, BPF_ANY)) {
+            log_error("Failed to add VIP %s: %s", addr, strerror(errno));
+            return -1;
+        }
+
+        log_info("Decapsulating packets for VIP %s", addr);
+    }
+
+    return 0;
+}
+
+void sigint_handler(int sig_no) {
+    log_debug("Closing program...");
+    cleanup_ifaces();
+    exit(0);
+}
+
+int main(int argc, const char **argv) {
+    const char *config_file = NULL;
+    const char *iface = NULL;
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('i', "iface", &iface, "Interface where to attach the BPF program", NULL, 0, 0),
+        OPT_STRING('c', "config", &config_file, "path to the l4_lb config file", NULL, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse,
+                      "\nRemoves the tunnel header l4_lb puts around the packets to this backend, "
+                      "so that it replies to the clients directly",
+                      "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (iface == NULL || config_file == NULL) {
+        log_error("Error, you must specify the interface and the config file");
+        exit(1);
+    }
+
+    ifindex_iface = if_nametoindex(iface);
+    if (!ifindex_iface) {
+        log_fatal("Error while retrieving the ifindex of %s", iface);
+        exit(1);
+    }
+
+    struct config *conf;
+    cyaml_err_t err;
+    err = cyaml_load_file(config_file, &config, &config_schema, (void **)&conf, NULL);
+    if (err != CYAML_OK) {
+        printf("Error loading YAML: %s\n", cyaml_strerror(err));
+        return 1;
+    }
+
+    __u16 encap_port = conf->encap_port;
+    if (encap_port == 0)
+        encap_port = conf->encap == LB_ENCAP_GUE ? DEFAULT_GUE_PORT : DEFAULT_FOU_PORT;
+
+    struct l4_decap_bpf *skel = l4_decap_bpf__open();
+    if (!skel) {
+        log_fatal("Error while opening BPF skeleton");
+        exit(1);
+    }
+
+    skel->rodata->l4_decap_cfg.encap = conf->encap;
+    skel->rodata->l4_decap_cfg.encap_port = htons(encap_port);
+
+    if (l4_decap_bpf__load(skel)) {
+        log_fatal("Error while loading BPF skeleton");
+        goto cleanup;
+    }
+
+    if (load_vips(skel, conf))
+        goto cleanup;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &sigint_handler;
+
+    if (sigaction(SIGINT, &action, NULL) == -1 || sigaction(SIGTERM, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
+
+    xdp_flags = XDP_FLAGS_DRV_MODE;
+    if (bpf_xdp_attach(ifindex_iface, bpf_program__fd(skel->progs.l4_decap), xdp_flags, NULL)) {
+        log_fatal("Error while attaching the XDP program to the interface");
+        goto cleanup;
+    }
+
+    log_info("Successfully attached to %s!", iface);
+    int stats_fd = bpf_map__fd(skel->maps.decap_stats);
+    for (;;) {
+        sleep(REPORT_INTERVAL_S);
+        log_info("decap: packets=%llu unknown_vip=%llu",
+                 read_decap_stat(stats_fd, DECAP_STAT_PACKETS),
+                 read_decap_stat(stats_fd, DECAP_STAT_UNKNOWN_VIP));
+    }
+
+cleanup:
+    cleanup_ifaces();
+    l4_decap_bpf__destroy(skel);
+    cyaml_free(&config, &config_schema, conf, 0);
+    return 1;
+}
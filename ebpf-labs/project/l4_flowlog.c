@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <argparse.h>
+
+#include "flow_log.h"
+#include "log.h"
+
+/* How often --follow looks for new records */
+#define FOLLOW_INTERVAL_MS 200
+
+static const char *const usages[] = {
+    "l4_flowlog [options] FILE",
+    NULL,
+};
+
+static const char *const event_names[] = {
+    [FLOW_EVENT_NEW] = "new",
+    [FLOW_EVENT_CLOSED] = "closed",
+    [FLOW_EVENT_EXPIRED] = "expired",
+    [FLOW_EVENT_REASSIGNED] = "reassigned",
+};
+
+/* Format an address and port as 10.0.0.1:80 or [fd00::1]:80 */
+static const char *endpoint_str(int ipv6, const __be32 *addr, __be16 port, char *buf, size_t len) {
+    char ip[INET6_ADDRSTRLEN];
+
+    inet_ntop(ipv6 ? AF_INET6 : AF_INET, addr, ip, sizeof(ip));
+    snprintf(buf, len, ipv6 ? "[%s]:%u" : "%s:%u", ip, ntohs(port));
+    return buf;
+}
+
+static void print_record(const struct flow_log_record *rec) {
+    char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8], backend[INET6_ADDRSTRLEN];
+    time_t sec = rec->time_ns / 1000000000ULL;
+    char when[32];
+    struct tm tm;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+    inet_ntop(rec->conn.ipv6 ? AF_INET6 : AF_INET, rec->backend, backend, sizeof(backend));
+
+    printf("%s.%06llu %-10s %s %s -> %s backend %s\n", when,
+           (rec->time_ns % 1000000000ULL) / 1000,
+           rec->type < sizeof(event_names) / sizeof(event_names[0]) ? event_names[rec->type] : "?",
+           rec->conn.proto == IPPROTO_TCP ? "tcp" : "udp",
+           endpoint_str(rec->conn.ipv6, rec->conn.src_addr6, rec->conn.src_port, src, sizeof(src)),
+           endpoint_str(rec->conn.ipv6, rec->conn.dst_addr6, rec->conn.dst_port, dst, sizeof(dst)),
+           backend);
+}
+
+int main(int argc, const char **argv) {
+    const char *backend = NULL;
+    int follow = 0;
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Basic options"),
+        OPT_STRING('b', "backend", &backend, "only show the flows of this backend", NULL, 0, 0),
+        OPT_BOOLEAN('f', "follow", &follow, "wait for new records at the end of the log", NULL, 0,
+                    0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, "\nPrints the flow events l4_lb wrote to a flow log", "");
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc != 1) {
+        argparse_usage(&argparse);
+        exit(1);
+    }
+
+    __be32 backend_addr[4] = {};
+    int backend_ipv6 = 0;
+    if (backend && inet_pton(AF_INET, backend, backend_addr) != 1) {
+        backend_ipv6 = 1;
+        if (inet_pton(AF_INET6, backend, backend_addr) != 1) {
+            log_error("Failed to convert backend %s to an IPv4 or IPv6 address", backend);
+            exit(1);
+        }
+    }
+
+    FILE *file = fopen(argv[0], "rb");
+    if (!file) {
+        log_error("Failed to open %s", argv[0]);
+        exit(1);
+    }
+
+    struct flow_log_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 || memcmp(hdr.magic, FLOW_LOG_MAGIC, 8) ||
+        hdr.version != FLOW_LOG_VERSION || hdr.record_size != sizeof(struct flow_log_record)) {
+        log_error("%s is not a flow log this version of l4_flowlog can read", argv[0]);
+        fclose(file);
+        exit(1);
+    }
+
+    struct flow_log_record rec;
+    for (;;) {
+        long pos = ftell(file);
+
+        if (fread(&rec, sizeof(rec), 1, file) != 1) {
+            if (!follow)
+                break;
+
+            // the record may be half written, read it again in full
+            clearerr(file);
+            fseek(file, pos, SEEK_SET);
+            fflush(stdout);
+            usleep(FOLLOW_INTERVAL_MS * 1000);
+            continue;
+        }
+
+        if (backend && (rec.conn.ipv6 != backend_ipv6 ||
+                        memcmp(rec.backend, backend_addr, sizeof(backend_addr))))
+            continue;
+
+        print_record(&rec);
+    }
+
+    fclose(file);
+    return 0;
+}
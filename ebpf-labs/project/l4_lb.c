@@ -5,12 +5,20 @@
 #include <bpf/btf.h>
 #include <bpf/libbpf.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/if_link.h>
 #include <netinet/in.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <argparse.h>
@@ -18,7 +26,14 @@
 
 #include <cyaml/cyaml.h>
 
+#include "bench.h"
+#include "conntrack.h"
+#include "ebpf/l4_lb_common.h"
+#include "flow_log.h"
+#include "health.h"
 #include "l4_lb.skel.h"
+#include "lb_state.h"
+#include "metrics.h"
 
 #ifndef __USE_POSIX
 #define __USE_POSIX
@@ -27,6 +42,34 @@
 
 #include "log.h"
 
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+
+/* How often the control plane publishes the backend scores */
+#define SCORE_INTERVAL_S 1
+/* How often the control plane removes idle flows and reports the table usage */
+#define CONNTRACK_SWEEP_INTERVAL_S 5
+/* How long a removed backend keeps its flows at most */
+#define DEFAULT_DRAIN_TIMEOUT_MS 300000
+/* MTU of the path to the backends */
+#define DEFAULT_MTU 1500
+/* bpffs directory the maps are pinned to, so that a restart keeps the flows */
+#define DEFAULT_PIN_PATH "/sys/fs/bpf/l4_lb"
+#define MAX_STATE_MAPS 16
+/* How long an upgrade waits for the running l4_lb to stop writing the maps */
+#define HANDOVER_TIMEOUT_S 10
+/* Health checks unless the config says otherwise, a dead backend is out within 800 ms */
+#define DEFAULT_HEALTH_INTERVAL_MS 200
+#define DEFAULT_HEALTH_FALL 3
+#define DEFAULT_HEALTH_RISE 2
+/* Events the main loop handles per wakeup */
+#define MAX_EVENTS 64
+/* Flows the sweeper reads or deletes per syscall */
+#define SWEEP_BATCH 4096
+/* The metrics are only served to the host itself unless the config says otherwise */
+#define DEFAULT_METRICS_ADDRESS "127.0.0.1"
+
 static const char *const usages[] = {
     "l4_lb [options] [[--] args]",
     "l4_lb [options]",
@@ -36,22 +79,77 @@ static const char *const usages[] = {
 // Define the structure to hold the YAML data
 struct backend_yaml {
     char *ip;
+    uint32_t *weight;
+    uint32_t max_conns;
 };
 
-struct backend {
-    __be32 ip;
-    __u64 num_flows;
-    __u64 num_packets;
+struct conntrack_yaml {
+    uint32_t max_flows;
+    uint32_t idle_timeout_ms;
+    uint32_t closing_timeout_ms;
 };
 
-struct config {
+struct rate_limit_yaml {
+    uint32_t pps;
+    uint32_t burst;
+};
+
+struct health_check_yaml {
+    enum health_proto proto;
+    uint16_t port;
+    uint32_t interval_ms;
+    uint32_t timeout_ms;
+    uint32_t fall;
+    uint32_t rise;
+};
+
+struct flow_log_yaml {
+    char *path;
+    uint32_t sample;
+};
+
+struct metrics_yaml {
+    char *address;
+    uint16_t port;
+};
+
+struct service_yaml {
     char *vip;
+    uint16_t port;
+    int proto;
+    struct rate_limit_yaml rate_limit;
+    char **backends;
+    size_t backends_count;
+};
+
+struct config {
+    enum lb_policy policy;
+    enum lb_encap encap;
+    uint16_t encap_port;
+    uint16_t mtu;
+    bool rx_hash;
+    bool syn_cookies;
+    struct conntrack_yaml conntrack;
+    uint32_t max_services;
+    uint32_t drain_timeout_ms;
+    uint32_t slow_start_ms;
+    struct health_check_yaml health_check;
+    struct flow_log_yaml flow_log;
+    struct metrics_yaml metrics;
+    char *gateway_mac;
+    char **redirect_ifaces;
+    size_t redirect_ifaces_count;
     struct backend_yaml *backends;
     size_t backends_count;
+    struct service_yaml *services;
+    size_t services_count;
 };
 
 static const cyaml_schema_field_t backend_field_schema[] = {
     CYAML_FIELD_STRING_PTR("ip", CYAML_FLAG_POINTER, struct backend_yaml, ip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT_PTR("weight", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct backend_yaml,
+                         weight),
+    CYAML_FIELD_UINT("max_conns", CYAML_FLAG_OPTIONAL, struct backend_yaml, max_conns),
     CYAML_FIELD_END,
 };
 
@@ -59,11 +157,121 @@ static const cyaml_schema_value_t backend_schema = {
     CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct backend_yaml, backend_field_schema),
 };
 
+static const cyaml_schema_field_t conntrack_field_schema[] = {
+    CYAML_FIELD_UINT("max_flows", CYAML_FLAG_OPTIONAL, struct conntrack_yaml, max_flows),
+    CYAML_FIELD_UINT("idle_timeout_ms", CYAML_FLAG_OPTIONAL, struct conntrack_yaml,
+                     idle_timeout_ms),
+    CYAML_FIELD_UINT("closing_timeout_ms", CYAML_FLAG_OPTIONAL, struct conntrack_yaml,
+                     closing_timeout_ms),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_strval_t proto_strings[] = {
+    {"udp", IPPROTO_UDP},
+    {"tcp", IPPROTO_TCP},
+};
+
+static const cyaml_schema_field_t rate_limit_field_schema[] = {
+    CYAML_FIELD_UINT("pps", CYAML_FLAG_DEFAULT, struct rate_limit_yaml, pps),
+    CYAML_FIELD_UINT("burst", CYAML_FLAG_OPTIONAL, struct rate_limit_yaml, burst),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_strval_t health_proto_strings[] = {
+    {"tcp", HEALTH_TCP},
+    {"udp", HEALTH_UDP},
+    {"icmp", HEALTH_ICMP},
+};
+
+static const cyaml_schema_field_t health_check_field_schema[] = {
+    CYAML_FIELD_ENUM("proto", CYAML_FLAG_DEFAULT, struct health_check_yaml, proto,
+                     health_proto_strings, CYAML_ARRAY_LEN(health_proto_strings)),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_OPTIONAL, struct health_check_yaml, port),
+    CYAML_FIELD_UINT("interval_ms", CYAML_FLAG_OPTIONAL, struct health_check_yaml, interval_ms),
+    CYAML_FIELD_UINT("timeout_ms", CYAML_FLAG_OPTIONAL, struct health_check_yaml, timeout_ms),
+    CYAML_FIELD_UINT("fall", CYAML_FLAG_OPTIONAL, struct health_check_yaml, fall),
+    CYAML_FIELD_UINT("rise", CYAML_FLAG_OPTIONAL, struct health_check_yaml, rise),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_schema_field_t flow_log_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("path", CYAML_FLAG_POINTER, struct flow_log_yaml, path, 0,
+                           CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("sample", CYAML_FLAG_OPTIONAL, struct flow_log_yaml, sample),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_schema_field_t metrics_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("address", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+                           struct metrics_yaml, address, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_DEFAULT, struct metrics_yaml, port),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_schema_value_t service_backend_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, CYAML_UNLIMITED),
+};
+
+static const cyaml_schema_field_t service_field_schema[] = {
+    CYAML_FIELD_STRING_PTR("vip", CYAML_FLAG_POINTER, struct service_yaml, vip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_UINT("port", CYAML_FLAG_OPTIONAL, struct service_yaml, port),
+    CYAML_FIELD_ENUM("proto", CYAML_FLAG_DEFAULT, struct service_yaml, proto, proto_strings,
+                     CYAML_ARRAY_LEN(proto_strings)),
+    CYAML_FIELD_MAPPING("rate_limit", CYAML_FLAG_OPTIONAL, struct service_yaml, rate_limit,
+                        rate_limit_field_schema),
+    CYAML_FIELD_SEQUENCE("backends", CYAML_FLAG_POINTER, struct service_yaml, backends,
+                         &service_backend_schema, 1, CYAML_UNLIMITED),
+    CYAML_FIELD_END,
+};
+
+static const cyaml_schema_value_t service_schema = {
+    CYAML_VALUE_MAPPING(CYAML_FLAG_DEFAULT, struct service_yaml, service_field_schema),
+};
+
+static const cyaml_schema_value_t iface_schema = {
+    CYAML_VALUE_STRING(CYAML_FLAG_POINTER, char, 0, IFNAMSIZ - 1),
+};
+
+static const cyaml_strval_t encap_strings[] = {
+    {"ipip", LB_ENCAP_IPIP},
+    {"fou", LB_ENCAP_FOU},
+    {"gue", LB_ENCAP_GUE},
+};
+
+static const cyaml_strval_t policy_strings[] = {
+    {"maglev", LB_POLICY_MAGLEV},
+    {"least_conn", LB_POLICY_LEAST_CONN},
+};
+
 /* CYAML mapping schema fields array for the top level mapping. */
 static const cyaml_schema_field_t top_mapping_schema[] = {
-    CYAML_FIELD_STRING_PTR("vip", CYAML_FLAG_POINTER, struct config, vip, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_ENUM("policy", CYAML_FLAG_OPTIONAL, struct config, policy, policy_strings,
+                     CYAML_ARRAY_LEN(policy_strings)),
+    CYAML_FIELD_ENUM("encap", CYAML_FLAG_OPTIONAL, struct config, encap, encap_strings,
+                     CYAML_ARRAY_LEN(encap_strings)),
+    CYAML_FIELD_UINT("encap_port", CYAML_FLAG_OPTIONAL, struct config, encap_port),
+    CYAML_FIELD_UINT("mtu", CYAML_FLAG_OPTIONAL, struct config, mtu),
+    CYAML_FIELD_BOOL("rx_hash", CYAML_FLAG_OPTIONAL, struct config, rx_hash),
+    CYAML_FIELD_BOOL("syn_cookies", CYAML_FLAG_OPTIONAL, struct config, syn_cookies),
+    CYAML_FIELD_MAPPING("conntrack", CYAML_FLAG_OPTIONAL, struct config, conntrack,
+                        conntrack_field_schema),
+    CYAML_FIELD_UINT("max_services", CYAML_FLAG_OPTIONAL, struct config, max_services),
+    CYAML_FIELD_UINT("drain_timeout_ms", CYAML_FLAG_OPTIONAL, struct config, drain_timeout_ms),
+    CYAML_FIELD_UINT("slow_start_ms", CYAML_FLAG_OPTIONAL, struct config, slow_start_ms),
+    CYAML_FIELD_MAPPING("health_check", CYAML_FLAG_OPTIONAL, struct config, health_check,
+                        health_check_field_schema),
+    CYAML_FIELD_MAPPING("flow_log", CYAML_FLAG_OPTIONAL, struct config, flow_log,
+                        flow_log_field_schema),
+    CYAML_FIELD_MAPPING("metrics", CYAML_FLAG_OPTIONAL, struct config, metrics,
+                        metrics_field_schema),
+    CYAML_FIELD_STRING_PTR("gateway_mac", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct config,
+                           gateway_mac, 0, CYAML_UNLIMITED),
+    CYAML_FIELD_SEQUENCE("redirect_ifaces", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL, struct config,
+                         redirect_ifaces, &iface_schema, 0, CYAML_UNLIMITED),
     CYAML_FIELD_SEQUENCE("backends", CYAML_FLAG_POINTER, struct config, backends, &backend_schema,
-                         0, CYAML_UNLIMITED),
+                         0, MAX_BACKENDS),
+    CYAML_FIELD_SEQUENCE("services", CYAML_FLAG_POINTER, struct config, services, &service_schema,
+                         1, MAX_SERVICES),
     CYAML_FIELD_END};
 
 /* CYAML value schema for the top level mapping. */
@@ -78,18 +286,832 @@ static const cyaml_config_t config = {
 };
 
 static int ifindex_iface = 0;
-static __u32 xdp_flags = 0;
+/* Link of the attached program, pinned to link_pin_path unless that is empty */
+static int xdp_link_fd = -1;
+static char link_pin_path[PATH_MAX];
+static __u32 entry_prog_id = 0;
+static struct lb_state lb_state;
+static struct conntrack conntrack;
+/* Probes the backends from the main loop once the program is attached */
+static struct health_checker health;
+/* Writes the sampled flow events of the data plane to a file */
+static struct flow_log flow_log;
+/* Batched snapshots of the counters of the data plane, served over HTTP */
+static struct metrics metrics;
+/* l4_lb_rx_hash is attached, which has the policy and encapsulation built in */
+static bool rx_hash_mode = false;
+static volatile sig_atomic_t reload_requested = 0;
+/* With pinned maps the program stays attached after exit and the next run takes over */
+static bool detach_on_exit = true;
+/* lb_stages, pinned so that the pipeline survives our exit */
+static char stages_pin_path[PATH_MAX];
+/* Lock file in the pin path, held by the l4_lb that writes the pinned maps */
+static int lock_fd = -1;
+static volatile sig_atomic_t handover_requested = 0;
+
+static __u32 prog_id(int prog_fd) {
+    struct bpf_prog_info info = {};
+    __u32 len = sizeof(info);
+
+    return bpf_obj_get_info_by_fd(prog_fd, &info, &len) ? 0 : info.id;
+}
+
+/* ID of the program that runs behind a link */
+static __u32 link_prog_id(int link_fd) {
+    struct bpf_link_info info = {};
+    __u32 len = sizeof(info);
 
+    return bpf_obj_get_info_by_fd(link_fd, &info, &len) ? 0 : info.prog_id;
+}
+
+/* Whether an upgrade swapped another program into our link */
+static bool replaced_by_upgrade() {
+    return xdp_link_fd >= 0 && link_prog_id(xdp_link_fd) != entry_prog_id;
+}
+
+/* Drop our reference to the link. With detach_on_exit its pins go as well,
+ * which detaches the program, otherwise the pins keep it running for the next
+ * l4_lb. After an upgrade the link runs the new program and belongs to the new
+ * l4_lb, so only our fd is closed.
+ */
 static void cleanup_ifaces() {
-    __u32 curr_prog_id = 0;
+    if (xdp_link_fd < 0)
+        return;
+
+    if (detach_on_exit && !replaced_by_upgrade()) {
+        if (link_pin_path[0])
+            unlink(link_pin_path);
+        if (stages_pin_path[0])
+            unlink(stages_pin_path);
+        log_trace("Detached XDP program from interface %d", ifindex_iface);
+    }
+
+    close(xdp_link_fd);
+    xdp_link_fd = -1;
+}
+
+/* Attach `prog` to the interface through a BPF link, pinned below `pin_dir`
+ * if it is given. If an earlier l4_lb left its link pinned there, running or
+ * not, the program of that link is replaced instead. The swap is atomic: every
+ * packet is handled either by the old or the new program, none by the network
+ * stack.
+ */
+static int attach_entry(struct bpf_program *prog, const char *pin_dir, int upgrade) {
+    int prog_fd = bpf_program__fd(prog);
+    int fd = -1;
+
+    link_pin_path[0] = 0;
+    if (pin_dir) {
+        snprintf(link_pin_path, sizeof(link_pin_path), "%s/link", pin_dir);
+        fd = bpf_obj_get(link_pin_path);
+    }
+
+    if (fd >= 0) {
+        if (bpf_link_update(fd, prog_fd, NULL)) {
+            log_error("Failed to replace the program of %s: %s", link_pin_path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (upgrade)
+            log_info("Replaced the running program, the old l4_lb exits by itself");
+        else
+            log_info("Replaced the program the previous l4_lb left attached");
+    } else {
+        LIBBPF_OPTS(bpf_link_create_opts, opts, .flags = XDP_FLAGS_DRV_MODE);
+
+        if (upgrade)
+            log_warn("There is no running l4_lb to upgrade, attaching");
+
+        fd = bpf_link_create(prog_fd, ifindex_iface, BPF_XDP, &opts);
+        if (fd < 0)
+            return -1;
+
+        if (pin_dir && bpf_obj_pin(fd, link_pin_path)) {
+            log_warn("Failed to pin %s, this l4_lb detaches on exit and can't be upgraded: %s",
+                     link_pin_path, strerror(errno));
+            link_pin_path[0] = 0;
+        }
+    }
+
+    xdp_link_fd = fd;
+    entry_prog_id = prog_id(prog_fd);
+    return 0;
+}
+
+static __u64 read_lb_stat(int stats_fd, __u32 stat) {
+    int ncpus = libbpf_num_possible_cpus();
+    __u64 values[ncpus];
+    __u64 sum = 0;
+
+    if (ncpus <= 0 || bpf_map_lookup_elem(stats_fd, &stat, values))
+        return 0;
+
+    for (int i = 0; i < ncpus; i++)
+        sum += values[i];
+
+    return sum;
+}
+
+/* Parse an IPv4 or IPv6 backend address into `be` */
+static int parse_backend_ip(const char *ip, struct backend *be) {
+    if (inet_pton(AF_INET, ip, &be->ip) == 1) {
+        be->ipv6 = 0;
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, ip, be->ip6) == 1) {
+        be->ipv6 = 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int get_iface_mac(const char *iface, __u8 *mac) {
+    struct ifreq ifr = {};
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int err;
+
+    if (fd < 0)
+        return -1;
+
+    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+    err = ioctl(fd, SIOCGIFHWADDR, &ifr);
+    close(fd);
+    if (err)
+        return -1;
+
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+    return 0;
+}
 
-    if (ifindex_iface != 0) {
-        if (!bpf_xdp_query_id(ifindex_iface, xdp_flags, &curr_prog_id)) {
-            if (curr_prog_id) {
-                bpf_xdp_detach(ifindex_iface, xdp_flags, NULL);
-                log_trace("Detached XDP program from interface %d", ifindex_iface);
+static int parse_mac(const char *str, __u8 *mac) {
+    return sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3],
+                  &mac[4], &mac[5]) == 6
+               ? 0
+               : -1;
+}
+
+/* Let the data plane redirect packets to the given interfaces when the next hop
+ * of a backend is behind them. Packets to other interfaces are dropped.
+ */
+static int configure_tx_ports(struct l4_lb_bpf *skel, char **ifaces, size_t count) {
+    int tx_ports_fd = bpf_map__fd(skel->maps.tx_ports);
+
+    for (size_t i = 0; i < count; i++) {
+        __u32 ifindex = if_nametoindex(ifaces[i]);
+
+        if (!ifindex) {
+            log_error("Error while retrieving the ifindex of %s", ifaces[i]);
+            return -1;
+        }
+
+        if (bpf_map_update_elem(tx_ports_fd, &ifindex, &ifindex, BPF_ANY)) {
+            log_error("Failed to add %s to the redirect interfaces: %s", ifaces[i],
+                      strerror(errno));
+            return -1;
+        }
+
+        log_info("Redirecting to %s (ifindex %u) when a backend is behind it", ifaces[i], ifindex);
+    }
+
+    return 0;
+}
+
+/* Maps whose contents outlive the daemon when they are pinned: the flows, the
+ * backend slots the flows point to and what the data plane knows about clients
+ */
+static int state_maps(struct l4_lb_bpf *skel, struct bpf_map **maps) {
+    int n = 0;
+
+    maps[n++] = skel->maps.connections_map;
+    maps[n++] = skel->maps.backend_map;
+    maps[n++] = skel->maps.backend_stats;
+    maps[n++] = skel->maps.services_map;
+    maps[n++] = skel->maps.maglev_map;
+    maps[n++] = skel->maps.syn_verified;
+    maps[n++] = skel->maps.ratelimit_map;
+    maps[n++] = skel->maps.ratelimit_drops;
+    assert(n <= MAX_STATE_MAPS);
+    return n;
+}
+
+/* Whether the pinned map behind `fd` can stand in for `map` */
+static bool pinned_map_compatible(const struct bpf_map *map, int fd) {
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+
+    if (bpf_obj_get_info_by_fd(fd, &info, &len))
+        return false;
+
+    return info.type == bpf_map__type(map) && info.key_size == bpf_map__key_size(map) &&
+           info.value_size == bpf_map__value_size(map) &&
+           info.max_entries == bpf_map__max_entries(map) &&
+           info.map_flags == bpf_map__map_flags(map);
+}
+
+/* Use the maps an earlier run pinned below `dir` instead of creating new ones.
+ * Maps that no longer match the program, e.g. because max_services changed,
+ * start empty. That is refused while the earlier program is still `attached`:
+ * it would keep working on the old map while the new one is written. Call
+ * before loading, returns the number of maps reused or -1.
+ */
+static int reuse_pinned_maps(struct l4_lb_bpf *skel, const char *dir, bool attached) {
+    struct bpf_map *maps[MAX_STATE_MAPS];
+    int count = state_maps(skel, maps);
+    char path[PATH_MAX];
+    int reused = 0;
+
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, bpf_map__name(maps[i]));
+        int fd = bpf_obj_get(path);
+        if (fd < 0)
+            continue;
+
+        if (!pinned_map_compatible(maps[i], fd) && attached) {
+            log_error("%s doesn't match the attached program, detach it first", path);
+            close(fd);
+            return -1;
+        } else if (!pinned_map_compatible(maps[i], fd))
+            log_warn("%s doesn't match the program, starting it empty", path);
+        else if (bpf_map__reuse_fd(maps[i], fd))
+            log_warn("Failed to reuse %s: %s", path, strerror(errno));
+        else
+            reused++;
+
+        // libbpf keeps its own copy of the fd
+        close(fd);
+    }
+
+    return reused;
+}
+
+/* Pin the state maps below `dir`, replacing the pins of maps that were not
+ * reused
+ */
+static int pin_state_maps(struct l4_lb_bpf *skel, const char *dir) {
+    struct bpf_map *maps[MAX_STATE_MAPS];
+    int count = state_maps(skel, maps);
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    // pin under a temporary name first, so that the pin is never missing
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, bpf_map__name(maps[i]));
+        snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.new", dir, bpf_map__name(maps[i]));
+        unlink(tmp_path);
+        if (bpf_obj_pin(bpf_map__fd(maps[i]), tmp_path) || rename(tmp_path, path)) {
+            log_error("Failed to pin %s: %s", path, strerror(errno));
+            unlink(tmp_path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* The kernel empties a program array once no file descriptor or pin refers to
+ * it, so the stages of a program left attached after exit have to be pinned.
+ * Called after attaching, so the stages of the program that was replaced stay
+ * in place until then.
+ */
+static int pin_stages(struct l4_lb_bpf *skel, const char *dir) {
+    snprintf(stages_pin_path, sizeof(stages_pin_path), "%s/%s", dir,
+             bpf_map__name(skel->maps.lb_stages));
+    unlink(stages_pin_path);
+    if (bpf_map__pin(skel->maps.lb_stages, stages_pin_path)) {
+        log_error("Failed to pin %s: %s", stages_pin_path, strerror(errno));
+        stages_pin_path[0] = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void handover_handler(int sig_no) {
+    handover_requested = 1;
+}
+
+static void handover_timeout(int sig_no) {
+}
+
+/* Become the only l4_lb that writes the maps pinned below `dir`, before any
+ * of them is touched. With `upgrade` the running l4_lb is asked to stop
+ * writing them and hand them over, otherwise it being there is an error.
+ */
+static int take_pin_lock(const char *dir, int upgrade) {
+    struct sigaction action = {.sa_handler = handover_handler};
+    char path[PATH_MAX], pid[16] = {};
+    int fd;
+
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        log_error("Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        if (errno != EWOULDBLOCK || !upgrade) {
+            log_error("Another l4_lb is running on %s, use --upgrade to replace it", dir);
+            close(fd);
+            return -1;
+        }
+
+        if (pread(fd, pid, sizeof(pid) - 1, 0) <= 0 || kill(atoi(pid), SIGUSR1)) {
+            log_error("Failed to ask the running l4_lb to hand over the maps");
+            close(fd);
+            return -1;
+        }
+        log_info("Waiting for l4_lb %d to hand over the maps", atoi(pid));
+
+        // no SA_RESTART, the alarm cuts the wait for the lock short
+        struct sigaction timeout = {.sa_handler = handover_timeout};
+        sigaction(SIGALRM, &timeout, NULL);
+        alarm(HANDOVER_TIMEOUT_S);
+        int err = flock(fd, LOCK_EX);
+        alarm(0);
+        if (err) {
+            log_error("l4_lb %d didn't hand over the maps", atoi(pid));
+            close(fd);
+            return -1;
+        }
+    }
+
+    // the next upgrade asks us
+    if (sigaction(SIGUSR1, &action, NULL) || ftruncate(fd, 0) ||
+        dprintf(fd, "%d\n", getpid()) < 0) {
+        log_error("Failed to take over %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    lock_fd = fd;
+    return 0;
+}
+
+/* An upgrading l4_lb asked for the maps: stop writing them and let it take
+ * over. The program keeps running from the link until the new l4_lb swaps in
+ * its own, then this one exits. Returns false if the new l4_lb gave up before
+ * that and the maps are ours again.
+ */
+static bool hand_over() {
+    if (lock_fd < 0)
+        return false;
+
+    log_info("Handing the maps over to the upgrading l4_lb");
+    flock(lock_fd, LOCK_UN);
+
+    for (int waited = 0;; waited++) {
+        if (replaced_by_upgrade())
+            return true;
+        usleep(100000);
+
+        // the new l4_lb holds the lock until it exits, give it time to take it
+        if (waited >= 10 && flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+            log_warn("The upgrade was abandoned, taking the maps back");
+            // the new l4_lb may have changed them, bring them in line again
+            reload_requested = 1;
+            return false;
+        }
+    }
+}
+
+/* Index of the backend with the same address as `be`, or -1 */
+static int find_backend(const struct lb_backend_conf *backends, size_t count,
+                        const struct backend *be) {
+    for (size_t i = 0; i < count; i++) {
+        if (backends[i].be.ipv6 == be->ipv6 &&
+            memcmp(backends[i].be.ip6, be->ip6, sizeof(be->ip6)) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Parse a service of the config into its key in services_map */
+static int parse_service(const struct service_yaml *svc, struct service_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->port = htons(svc->port);
+    key->proto = svc->proto;
+
+    if (inet_pton(AF_INET, svc->vip, &key->vip) == 1)
+        return 0;
+
+    if (inet_pton(AF_INET6, svc->vip, key->vip6) == 1) {
+        key->ipv6 = 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Translate the backends and services of the config and load them */
+static int apply_config(struct lb_state *st, const struct config *conf) {
+    struct lb_backend_conf *backends = calloc(conf->backends_count + 1, sizeof(*backends));
+    struct lb_service_conf *services = calloc(conf->services_count + 1, sizeof(*services));
+    size_t pools_count = 0;
+    int *pools;
+    int err = -EINVAL;
+
+    for (int s = 0; s < conf->services_count; s++)
+        pools_count += conf->services[s].backends_count;
+    pools = calloc(pools_count + 1, sizeof(*pools));
+
+    if (!backends || !services || !pools) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (int i = 0; i < conf->backends_count; i++) {
+        if (parse_backend_ip(conf->backends[i].ip, &backends[i].be)) {
+            log_error("Failed to convert IP %s to integer", conf->backends[i].ip);
+            goto out;
+        }
+        backends[i].weight = conf->backends[i].weight ? *conf->backends[i].weight : 1;
+        backends[i].max_conns = conf->backends[i].max_conns;
+    }
+
+    int *pool = pools;
+    for (int s = 0; s < conf->services_count; s++) {
+        const struct service_yaml *svc_yaml = &conf->services[s];
+
+        if (parse_service(svc_yaml, &services[s].key)) {
+            log_error("Failed to convert VIP %s to an IPv4 or IPv6 address", svc_yaml->vip);
+            goto out;
+        }
+
+        log_info("Loading service %s port %u proto %s", svc_yaml->vip, svc_yaml->port,
+                 svc_yaml->proto == IPPROTO_TCP ? "tcp" : "udp");
+
+        services[s].rate_limit = svc_yaml->rate_limit.pps;
+        services[s].rate_burst = svc_yaml->rate_limit.burst;
+        if (services[s].rate_limit)
+            log_info("Limiting every client of %s to %u packets/s", svc_yaml->vip,
+                     services[s].rate_limit);
+
+        services[s].backends = pool;
+        for (int b = 0; b < svc_yaml->backends_count; b++) {
+            struct backend be = {};
+            int idx;
+
+            if (parse_backend_ip(svc_yaml->backends[b], &be) ||
+                (idx = find_backend(backends, conf->backends_count, &be)) < 0) {
+                log_error("Backend %s of service %s is not in the backends list",
+                          svc_yaml->backends[b], svc_yaml->vip);
+                goto out;
             }
+
+            pool[services[s].backends_count++] = idx;
         }
+        pool += services[s].backends_count;
+    }
+
+    err = lb_state_apply(st, backends, conf->backends_count, services, conf->services_count);
+out:
+    free(backends);
+    free(services);
+    free(pools);
+    return err;
+}
+
+/* Install the selection policy and encapsulation stages of the config */
+static int apply_pipeline(struct lb_state *st, const struct config *conf) {
+    __u16 encap_port = conf->encap_port;
+    if (encap_port == 0)
+        encap_port = conf->encap == LB_ENCAP_GUE ? DEFAULT_GUE_PORT : DEFAULT_FOU_PORT;
+
+    __u16 mtu = conf->mtu;
+    if (mtu == 0)
+        mtu = DEFAULT_MTU;
+    lb_state_set_mtu(st, mtu);
+
+    if (conf->syn_cookies)
+        log_info("Challenging the SYNs of unverified clients with SYN cookies");
+    lb_state_set_syn_cookies(st, conf->syn_cookies);
+    lb_state_set_slow_start(st, conf->slow_start_ms * 1000000ULL);
+
+    if (rx_hash_mode && (conf->policy != st->skel->rodata->l4_lb_cfg.policy ||
+                         conf->encap != st->skel->rodata->l4_lb_cfg.encap))
+        log_warn("policy and encap only change with a restart when rx_hash is used");
+
+    log_info("Selecting backends by %s",
+             conf->policy == LB_POLICY_LEAST_CONN ? "least_conn" : "maglev");
+    if (conf->encap != LB_ENCAP_IPIP)
+        log_info("Encapsulating in %s to port %u", conf->encap == LB_ENCAP_GUE ? "GUE" : "FOU",
+                 encap_port);
+
+    return lb_state_set_pipeline(st, conf->policy, conf->encap, encap_port);
+}
+
+/* Check the backends as the config says. Backends that fail `fall` checks in a
+ * row are taken out of the rings and their flows move to other backends.
+ */
+static int apply_health_check(struct health_checker *hc, const struct config *conf) {
+    const struct health_check_yaml *yaml = &conf->health_check;
+    struct health_conf hconf = {
+        .proto = yaml->proto,
+        .port = yaml->port,
+        .interval_ms = yaml->interval_ms ? yaml->interval_ms : DEFAULT_HEALTH_INTERVAL_MS,
+        .fall = yaml->fall ? yaml->fall : DEFAULT_HEALTH_FALL,
+        .rise = yaml->rise ? yaml->rise : DEFAULT_HEALTH_RISE,
+    };
+
+    hconf.timeout_ms = yaml->timeout_ms ? yaml->timeout_ms : hconf.interval_ms;
+    if (hconf.timeout_ms > hconf.interval_ms) {
+        log_warn("The health check timeout is cut to the interval of %u ms", hconf.interval_ms);
+        hconf.timeout_ms = hconf.interval_ms;
+    }
+
+    if ((hconf.proto == HEALTH_TCP || hconf.proto == HEALTH_UDP) && hconf.port == 0) {
+        log_error("TCP and UDP health checks need a port");
+        return -EINVAL;
+    }
+
+    if (hconf.proto != HEALTH_NONE)
+        log_info("Checking the backends over %s every %u ms, down after %u failed checks, up "
+                 "after %u good ones",
+                 hconf.proto == HEALTH_TCP   ? "tcp"
+                 : hconf.proto == HEALTH_UDP ? "udp"
+                                             : "icmp",
+                 hconf.interval_ms, hconf.fall, hconf.rise);
+    health_configure(hc, &hconf);
+    return 0;
+}
+
+/* Log the events of the flows the config samples to its flow log, or stop */
+static int apply_flow_log(struct lb_state *st, struct flow_log *fl, const struct config *conf) {
+    const char *path = conf->flow_log.path;
+    __u32 sample = conf->flow_log.sample ? conf->flow_log.sample : 1;
+    int err = flow_log_set_path(fl, path);
+
+    // without a file the events would only be read and dropped
+    if (err || !path) {
+        lb_state_set_flow_log_sample(st, 0);
+        return err;
+    }
+
+    log_info("Logging 1 in %u flows", sample);
+    lb_state_set_flow_log_sample(st, sample);
+    return 0;
+}
+
+/* Serve the metrics where the config says, or stop serving them */
+static int apply_metrics(struct metrics *m, const struct config *conf) {
+    const char *address = conf->metrics.address ? conf->metrics.address : DEFAULT_METRICS_ADDRESS;
+
+    return metrics_listen(m, address, conf->metrics.port);
+}
+
+/* Load the config again and apply its pipeline stages, backends, services,
+ * health checks, flow log, metrics endpoint and the size of the connection
+ * table. Everything else is baked into the loaded program and needs a restart
+ * to change.
+ */
+static void reload_config(const char *config_file) {
+    struct config *conf;
+    cyaml_err_t err;
+
+    log_info("Reloading %s", config_file);
+    err = cyaml_load_file(config_file, &config, &config_schema, (void **)&conf, NULL);
+    if (err != CYAML_OK) {
+        log_error("Error loading YAML: %s, keeping the current config", cyaml_strerror(err));
+        return;
+    }
+
+    __u32 max_flows = conf->conntrack.max_flows;
+    if (max_flows == 0)
+        max_flows = DEFAULT_CONNTRACK_MAX_FLOWS;
+
+    if (apply_pipeline(&lb_state, conf) || apply_config(&lb_state, conf) ||
+        apply_health_check(&health, conf) || apply_flow_log(&lb_state, &flow_log, conf) ||
+        apply_metrics(&metrics, conf) || conntrack_resize(&conntrack, max_flows))
+        log_error("Error while applying %s", config_file);
+    else
+        log_info("Applied %s", config_file);
+
+    cyaml_free(&config, &config_schema, conf, 0);
+}
+
+struct conntrack_sweeper {
+    __u64 idle_timeout_ns;
+    __u64 closing_timeout_ns;
+    __u64 swept;   /* flows deleted by the sweeper so far */
+    __u64 alive;   /* flows the last sweep left in the table */
+    __u64 *live;   /* active flows per backend found by the last sweep */
+    __s64 *adjust; /* active flows per backend the data plane never saw ending */
+    __u32 backend_count;
+    /* One batch of flows read from a shard, the stale ones are moved to the front */
+    struct connection *keys;
+    struct flow_state *flows;
+    __u64 sweep_ns; /* time the last sweep took */
+    __u32 syscalls; /* bpf() calls the last sweep took */
+};
+
+/* Count a flow the sweeper deleted and log its end if the flow log samples it */
+static void conntrack_swept_flow(struct conntrack_sweeper *sweeper, const struct connection *key,
+                                 const struct flow_state *flow, __u64 now) {
+    sweeper->swept++;
+    // the end of a closing flow was logged when it closed
+    if (flow->logged && flow->state == FLOW_STATE_ACTIVE) {
+        struct flow_event ev = {
+            .timestamp_ns = now,
+            .conn = *key,
+            .backend_idx = flow->backend_idx,
+            .type = FLOW_EVENT_EXPIRED,
+        };
+
+        flow_log_add(&flow_log, &ev);
+    }
+}
+
+/* Delete the first `stale` flows of the batch. A flow the data plane or the
+ * LRU removed in the meantime stops the deletion, which goes on after it.
+ */
+static void conntrack_delete_stale(struct conntrack_sweeper *sweeper, int conntrack_fd,
+                                   __u32 stale, __u64 now) {
+    for (__u32 done = 0; done < stale;) {
+        __u32 count = stale - done;
+        int err = bpf_map_delete_batch(conntrack_fd, sweeper->keys + done, &count, NULL);
+        // logging the swept flows may change errno
+        int saved_errno = errno;
+
+        sweeper->syscalls++;
+        for (__u32 i = done; i < done + count; i++)
+            conntrack_swept_flow(sweeper, &sweeper->keys[i], &sweeper->flows[i], now);
+        done += count;
+
+        if (err && saved_errno != ENOENT)
+            break;
+        if (err)
+            done++;
+    }
+}
+
+/* Delete the flows of one shard that have been idle for longer than their
+ * timeout and return the number of flows that are still alive. The shard is
+ * read and cleaned up SWEEP_BATCH flows per syscall, deleting what was already
+ * read doesn't disturb where the next batch starts.
+ */
+static __u64 conntrack_sweep_shard(struct conntrack_sweeper *sweeper, int conntrack_fd,
+                                   __u64 now) {
+    void *in_batch = NULL;
+    __u64 alive = 0;
+    __u32 token;
+    int err;
+
+    do {
+        __u32 count = SWEEP_BATCH, stale = 0;
+
+        err = bpf_map_lookup_batch(conntrack_fd, in_batch, &token, sweeper->keys,
+                                   sweeper->flows, &count, NULL);
+        sweeper->syscalls++;
+        // the end of the shard is reported together with the last flows
+        if (err && errno != ENOENT) {
+            log_error("Failed to read the connection table: %s", strerror(errno));
+            break;
+        }
+        in_batch = &token;
+
+        for (__u32 i = 0; i < count; i++) {
+            const struct flow_state *flow = &sweeper->flows[i];
+            __u64 timeout = flow->state == FLOW_STATE_CLOSING ? sweeper->closing_timeout_ns
+                                                              : sweeper->idle_timeout_ns;
+
+            if (now > flow->last_seen && now - flow->last_seen > timeout) {
+                sweeper->keys[stale] = sweeper->keys[i];
+                sweeper->flows[stale] = *flow;
+                stale++;
+                continue;
+            }
+
+            alive++;
+            if (flow->state == FLOW_STATE_ACTIVE && flow->backend_idx < sweeper->backend_count)
+                sweeper->live[flow->backend_idx]++;
+        }
+
+        conntrack_delete_stale(sweeper, conntrack_fd, stale, now);
+    } while (!err);
+
+    return alive;
+}
+
+/* Walk the connection table shard by shard, delete the idle flows and count
+ * the flows that are still alive. The data plane only notices an idle flow
+ * when a packet of it shows up again, so without this the LRU would be the
+ * only way entries ever leave the table.
+ */
+static void conntrack_sweep(struct conntrack_sweeper *sweeper, const struct conntrack *ct) {
+    struct timespec ts;
+
+    memset(sweeper->live, 0, sweeper->backend_count * sizeof(*sweeper->live));
+    sweeper->alive = 0;
+    sweeper->syscalls = 0;
+
+    // bpf_ktime_get_ns() uses the monotonic clock as well
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    __u64 now = (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    for (int i = 0; i < CONNTRACK_SHARDS; i++)
+        sweeper->alive += conntrack_sweep_shard(sweeper, ct->shard_fds[i], now);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sweeper->sweep_ns = (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec - now;
+}
+
+/* The data plane can't see flows leaving the table through the sweeper or the
+ * LRU, so its active flow counters only ever drift upwards. Remember the
+ * difference to what the sweep actually found so the scores reflect live flows.
+ */
+static void conntrack_adjust(struct conntrack_sweeper *sweeper,
+                             const struct metrics_sample *sample) {
+    for (__u32 i = 0; i < sweeper->backend_count; i++) {
+        const struct backend_stats *stats = &sample->stats[i];
+
+        sweeper->adjust[i] = stats->active_flows - (__s64)sweeper->live[i];
+        log_debug("backend %u: %llu active flows, %llu flows, %llu packets", i, sweeper->live[i],
+                  stats->num_flows, stats->num_packets);
+    }
+}
+
+/* Publish the aggregated active flow counters of the snapshot as the score of
+ * each backend in backend_map, which the data plane only reads.
+ */
+static void backend_publish_scores(struct conntrack_sweeper *sweeper, struct l4_lb_bpf *skel,
+                                   struct metrics_sample *sample) {
+    int backend_fd = bpf_map__fd(skel->maps.backend_map);
+
+    for (__u32 i = 0; i < sweeper->backend_count; i++) {
+        struct backend *be = &sample->backends[i];
+        __s64 active = sample->stats[i].active_flows - sweeper->adjust[i];
+        __u64 score = active > 0 ? active : 0;
+
+        if (score == be->score)
+            continue;
+
+        // the snapshot is what backend_map holds now, the control plane being the only writer
+        be->score = score;
+        bpf_map_update_elem(backend_fd, &i, be, BPF_EXIST);
+    }
+}
+
+static void conntrack_report(struct conntrack_sweeper *sweeper,
+                             const struct metrics_sample *sample) {
+    const __u64 *stats = sample->lb_stats;
+    __u32 max_flows = conntrack_max_flows(&conntrack);
+    __u64 alive = sweeper->alive;
+
+    conntrack_adjust(sweeper, sample);
+    metrics_set_conntrack(&metrics, alive, max_flows, sweeper->swept, sweeper->sweep_ns,
+                          sweeper->syscalls);
+
+    // every created flow is still in the table, swept by us, reset or evicted by the LRU
+    __u64 gone = alive + sweeper->swept + stats[LB_STAT_FLOWS_RESET];
+    __u64 created = stats[LB_STAT_FLOWS_CREATED];
+    __u64 evicted = created > gone ? created - gone : 0;
+
+    log_info("conntrack: %llu/%u flows (%.1f%%), created=%llu expired=%llu closed=%llu "
+             "swept=%llu evicted=%llu insert_failed=%llu tcp_no_state=%llu",
+             alive, max_flows, 100.0 * alive / max_flows, created, stats[LB_STAT_FLOWS_EXPIRED],
+             stats[LB_STAT_FLOWS_CLOSED], sweeper->swept, evicted, stats[LB_STAT_CONNTRACK_FULL],
+             stats[LB_STAT_TCP_NO_STATE]);
+    log_info("forwarding: reassigned=%llu backend_full=%llu fib_failed=%llu tail_call_failed=%llu "
+             "fragments=%llu frag_unknown=%llu icmp_too_big=%llu rx_hash_missing=%llu "
+             "flow_events_lost=%llu encap_failed=%llu",
+             stats[LB_STAT_FLOWS_REASSIGNED], stats[LB_STAT_BACKEND_FULL],
+             stats[LB_STAT_FIB_FAILED], stats[LB_STAT_TAIL_CALL_FAILED], stats[LB_STAT_FRAGMENTS],
+             stats[LB_STAT_FRAG_UNKNOWN], stats[LB_STAT_ICMP_TOO_BIG],
+             stats[LB_STAT_RX_HASH_MISSING], stats[LB_STAT_FLOW_EVENTS_LOST],
+             stats[LB_STAT_ENCAP_FAILED]);
+    log_info("syn cookies: challenged=%llu verified=%llu", stats[LB_STAT_SYN_CHALLENGED],
+             stats[LB_STAT_SYN_VERIFIED]);
+}
+
+/* Report the packets every service dropped because its clients were over
+ * their rate, so that the limits can be tuned.
+ */
+static void ratelimit_report(struct lb_state *st) {
+    int drops_fd = bpf_map__fd(st->skel->maps.ratelimit_drops);
+    char vip[INET6_ADDRSTRLEN];
+
+    for (__u32 i = 0; i < st->max_services; i++) {
+        const struct lb_service_slot *s = &st->services[i];
+
+        if (!s->in_use || !s->svc.rate_interval_ns)
+            continue;
+
+        inet_ntop(s->key.ipv6 ? AF_INET6 : AF_INET, s->key.vip6, vip, sizeof(vip));
+        log_info("rate limit: %s port %u proto %s dropped=%llu", vip, ntohs(s->key.port),
+                 s->key.proto == IPPROTO_TCP ? "tcp" : "udp", read_lb_stat(drops_fd, i));
     }
 }
 
@@ -99,17 +1121,39 @@ void sigint_handler(int sig_no) {
     exit(0);
 }
 
+void sighup_handler(int sig_no) {
+    reload_requested = 1;
+}
+
 int main(int argc, const char **argv) {
 
     // ARGPARSE
 
     const char *config_file = NULL;
     const char *iface = NULL;
+    int bench_iterations = 0;
+    const char *pin_path = DEFAULT_PIN_PATH;
+    int no_pin = 0;
+    int detach = 0;
+    int upgrade = 0;
+    int exit_code = 1;
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_GROUP("Basic options"),
         OPT_STRING('i', "iface", &iface, "Interface where to attach the BPF program", NULL, 0, 0),
         OPT_STRING('c', "config", &config_file, "path to the config file", NULL, 0, 0),
+        OPT_INTEGER('b', "bench", &bench_iterations,
+                    "measure the ns per packet with N packets per case instead of attaching", NULL,
+                    0, 0),
+        OPT_STRING(0, "pin-path", &pin_path,
+                   "bpffs directory where the flows and backends are kept across restarts", NULL,
+                   0, 0),
+        OPT_BOOLEAN(0, "no-pin", &no_pin, "start with empty maps and don't pin them", NULL, 0, 0),
+        OPT_BOOLEAN(0, "detach", &detach, "detach the program on exit even if the maps are pinned",
+                    NULL, 0, 0),
+        OPT_BOOLEAN('u', "upgrade", &upgrade,
+                    "replace the running l4_lb without a gap, taking over its pinned maps", NULL, 0,
+                    0),
         OPT_END(),
     };
 
@@ -131,7 +1175,7 @@ int main(int argc, const char **argv) {
         } else {
             log_info("Got ifindex for iface: %s, which is %d", iface, ifindex_iface);
         }
-    } else {
+    } else if (bench_iterations <= 0) {
         log_error("Error, you must specify the interface where to attach the XDP program");
         exit(1);
     }
@@ -157,48 +1201,160 @@ int main(int argc, const char **argv) {
         exit(1);
     }
 
-    struct in_addr vip;
-    int ret = inet_pton(AF_INET, conf->vip, &vip);
-    if (ret != 1) {
-        log_error("Failed to convert VIP %s to integer", conf->vip);
+    __u32 max_services = conf->max_services;
+    if (max_services < conf->services_count)
+        max_services = conf->services_count;
+    if (max_services > MAX_SERVICES) {
+        log_error("At most %d services are supported", MAX_SERVICES);
         return 1;
     }
 
+    __u64 drain_timeout_ms = conf->drain_timeout_ms;
+    if (drain_timeout_ms == 0)
+        drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+
+    __u32 max_flows = conf->conntrack.max_flows;
+    if (max_flows == 0)
+        max_flows = DEFAULT_CONNTRACK_MAX_FLOWS;
+
+    __u64 idle_timeout_ms = conf->conntrack.idle_timeout_ms;
+    if (idle_timeout_ms == 0)
+        idle_timeout_ms = DEFAULT_CONNTRACK_IDLE_TIMEOUT_MS;
+    __u64 idle_timeout_ns = idle_timeout_ms * 1000000ULL;
+
+    __u64 closing_timeout_ms = conf->conntrack.closing_timeout_ms;
+    if (closing_timeout_ms == 0)
+        closing_timeout_ms = DEFAULT_CONNTRACK_CLOSING_TIMEOUT_MS;
+    __u64 closing_timeout_ns = closing_timeout_ms * 1000000ULL;
+
+    log_info("Sizing conntrack table for %u flows, idle timeout %llu ms", max_flows,
+             idle_timeout_ms);
+    // the unsharded table is only there to compare the shards with
+    if (bpf_map__set_max_entries(skel->maps.bench_conntrack,
+                                 bench_iterations > 0 ? max_flows : 1)) {
+        log_fatal("Error while setting the size of the benchmark conntrack table");
+        exit(1);
+    }
+
+    // the Maglev rings of all services that can ever be configured
+    if (bpf_map__set_max_entries(skel->maps.maglev_map, lb_state_maglev_entries(max_services))) {
+        log_fatal("Error while setting the size of the Maglev table");
+        exit(1);
+    }
+
     log_info("Setting rodata");
-    skel->rodata->l4_lb_cfg.vip = vip;
-    skel->rodata->l4_lb_cfg.backend_count = conf->backends_count;
+    skel->rodata->l4_lb_cfg.flow_idle_timeout_ns = idle_timeout_ns;
+    skel->rodata->l4_lb_cfg.flow_closing_timeout_ns = closing_timeout_ns;
 
     bpf_program__set_type(skel->progs.l4_lb, BPF_PROG_TYPE_XDP);
+
+    /* Only a program bound to the device can read the NIC's RSS hash. The
+     * benchmark isn't attached and always runs the tail call pipeline.
+     */
+    rx_hash_mode = conf->rx_hash && bench_iterations <= 0;
+    if (rx_hash_mode) {
+        log_info("Using the RSS hash of %s, policy and encap are fixed until a restart", iface);
+        bpf_program__set_ifindex(skel->progs.l4_lb_rx_hash, ifindex_iface);
+        bpf_program__set_flags(skel->progs.l4_lb_rx_hash, BPF_F_XDP_DEV_BOUND_ONLY);
+        skel->rodata->l4_lb_cfg.policy = conf->policy;
+        skel->rodata->l4_lb_cfg.encap = conf->encap;
+    } else {
+        bpf_program__set_autoload(skel->progs.l4_lb_rx_hash, false);
+    }
+    if (bench_iterations <= 0)
+        bench_skip_programs(skel);
+
+    // the benchmark works on maps of its own
+    if (bench_iterations > 0)
+        no_pin = 1;
+    if (upgrade && no_pin) {
+        log_fatal("An upgrade takes over the pinned maps, it can't be combined with --no-pin");
+        exit(1);
+    }
+    detach_on_exit = no_pin || detach;
+    if (!no_pin) {
+        // a pinned link runs the program of an earlier l4_lb on these maps
+        char link_path[PATH_MAX];
+        snprintf(link_path, sizeof(link_path), "%s/link", pin_path);
+        bool attached = access(link_path, F_OK) == 0;
+        if (attached)
+            log_info("Taking over the program attached through %s", link_path);
+
+        int reused = reuse_pinned_maps(skel, pin_path, attached);
+        if (reused < 0)
+            exit(1);
+        if (reused)
+            log_info("Reusing %d maps pinned in %s", reused, pin_path);
+    }
+
     /* Load and verify BPF programs */
     if (l4_lb_bpf__load(skel)) {
         log_fatal("Error while loading BPF skeleton");
         exit(1);
     }
 
-    int backend_map = bpf_map__fd(skel->maps.backend_map);
-    if (backend_map < 0) {
-        log_error("Failed to get file descriptor of BPF map: %s", strerror(errno));
-        return 1;
+    // from here on the pinned maps are written, the running l4_lb has to stop first
+    if (!no_pin && take_pin_lock(pin_path, upgrade)) {
+        log_fatal("Error while taking over %s", pin_path);
+        exit(1);
     }
 
-    // Access data
-    printf("VIP: %s\n", conf->vip);
-    printf("Backends %ld:\n", conf->backends_count);
+    if (conntrack_init(&conntrack, skel, max_flows)) {
+        log_fatal("Error while creating the conntrack table");
+        goto cleanup;
+    }
 
-    for (int i = 0; i < conf->backends_count; i++) {
-        log_info("Loading IP %s", conf->backends[i].ip);
-
-        // Convert the IP to an integer
-        struct backend be;
-        be.num_flows = 0;
-        be.num_packets = 0;
-        int ret = inet_pton(AF_INET, conf->backends[i].ip, &be.ip);
-        if (ret != 1) {
-            log_error("Failed to convert IP %s to integer", conf->backends[i].ip);
-            continue;
-        }
+    if (lb_state_init(&lb_state, skel, max_services, drain_timeout_ms * 1000000ULL)) {
+        log_fatal("Out of memory");
+        goto cleanup;
+    }
+
+    if (configure_tx_ports(skel, conf->redirect_ifaces, conf->redirect_ifaces_count)) {
+        log_fatal("Error while configuring the redirect interfaces");
+        goto cleanup;
+    }
+
+    // the outer Ethernet header is part of the backend templates
+    __u8 src_mac[6] = {};
+    __u8 gateway_mac[6];
+    if (iface && get_iface_mac(iface, src_mac))
+        log_warn("Failed to get the MAC address of %s", iface);
+    if (conf->gateway_mac && parse_mac(conf->gateway_mac, gateway_mac)) {
+        log_fatal("Failed to parse gateway MAC %s", conf->gateway_mac);
+        goto cleanup;
+    }
+    lb_state_set_next_hop(&lb_state, src_mac, conf->gateway_mac ? gateway_mac : NULL);
+    if (lb_state_adopt(&lb_state)) {
+        log_fatal("Error while taking over the backends of the pinned maps");
+        goto cleanup;
+    }
+    if (apply_pipeline(&lb_state, conf)) {
+        log_fatal("Error while installing the pipeline stages");
+        goto cleanup;
+    }
+
+    printf("Backends %ld, services %ld:\n", conf->backends_count, conf->services_count);
+    if (apply_config(&lb_state, conf)) {
+        log_fatal("Error while loading the backends and services");
+        goto cleanup;
+    }
+
+    if (!no_pin && pin_state_maps(skel, pin_path))
+        log_warn("The maps are not pinned, a restart starts from scratch");
 
-        bpf_map_update_elem(backend_map, &i, &be, 0);
+    if (bench_iterations > 0) {
+        struct service_key services[max_services];
+        struct bench_opts bench = {
+            .iterations = bench_iterations,
+            .services = services,
+        };
+
+        for (__u32 s = 0; s < max_services; s++) {
+            if (lb_state.services[s].in_use)
+                services[bench.services_count++] = lb_state.services[s].key;
+        }
+        exit_code = bench_run(skel, &bench) ? 1 : 0;
+        goto cleanup;
     }
 
     struct sigaction action;
@@ -215,26 +1371,143 @@ int main(int argc, const char **argv) {
         goto cleanup;
     }
 
-    xdp_flags = 0;
-    xdp_flags |= XDP_FLAGS_DRV_MODE;
+    action.sa_handler = &sighup_handler;
+    if (sigaction(SIGHUP, &action, NULL) == -1) {
+        log_error("sigation failed");
+        goto cleanup;
+    }
 
     /* Attach the XDP program to the interface */
-    err = bpf_xdp_attach(ifindex_iface, bpf_program__fd(skel->progs.l4_lb), xdp_flags, NULL);
-
-    if (err) {
+    struct bpf_program *entry = rx_hash_mode ? skel->progs.l4_lb_rx_hash : skel->progs.l4_lb;
+    if (attach_entry(entry, no_pin ? NULL : pin_path, upgrade)) {
         log_fatal("Error while attaching the XDP program to the interface");
         goto cleanup;
     }
 
     log_info("Successfully attached!");
-    while (1) {
-        sleep(10000);
+    if (!no_pin && pin_stages(skel, pin_path)) {
+        log_warn("The pipeline stages are not pinned, the program is detached on exit");
+        detach_on_exit = true;
+    }
+    struct conntrack_sweeper sweeper = {
+        .idle_timeout_ns = idle_timeout_ns,
+        .closing_timeout_ns = closing_timeout_ns,
+        .live = calloc(MAX_BACKENDS, sizeof(*sweeper.live)),
+        .adjust = calloc(MAX_BACKENDS, sizeof(*sweeper.adjust)),
+        .backend_count = MAX_BACKENDS,
+        .keys = calloc(SWEEP_BATCH, sizeof(*sweeper.keys)),
+        .flows = calloc(SWEEP_BATCH, sizeof(*sweeper.flows)),
+    };
+    if (!sweeper.live || !sweeper.adjust || !sweeper.keys || !sweeper.flows) {
+        log_fatal("Out of memory");
+        goto cleanup;
+    }
+
+    /* Everything the control plane does from here on is driven by one epoll:
+     * the periodic tick, whose event carries no source, the sockets and timer
+     * of the health checker, the flow events and the metrics endpoint.
+     */
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec every_tick = {
+        .it_interval = {.tv_sec = SCORE_INTERVAL_S},
+        .it_value = {.tv_sec = SCORE_INTERVAL_S},
+    };
+    if (epoll_fd < 0 || tick_fd < 0 || timerfd_settime(tick_fd, 0, &every_tick, NULL) ||
+        event_loop_add(epoll_fd, tick_fd, EPOLLIN, NULL)) {
+        log_fatal("Error while setting up the main loop: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    if (health_init(&health, &lb_state, epoll_fd) || apply_health_check(&health, conf)) {
+        log_fatal("Error while starting the health checks");
+        goto cleanup;
+    }
+
+    if (flow_log_init(&flow_log, &lb_state, epoll_fd) ||
+        apply_flow_log(&lb_state, &flow_log, conf)) {
+        log_fatal("Error while starting the flow log");
+        goto cleanup;
+    }
+
+    if (metrics_init(&metrics, &lb_state, epoll_fd) || apply_metrics(&metrics, conf)) {
+        log_fatal("Error while starting the metrics");
+        goto cleanup;
+    }
+
+    for (unsigned long tick = 0;;) {
+        struct epoll_event events[MAX_EVENTS];
+        __u64 expirations;
+
+        // a signal cuts the wait short, so a reload is applied right away
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            log_fatal("Error while waiting for events: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct event_source *src = events[i].data.ptr;
+
+            if (src) {
+                src->handle(src->ctx, events[i].events);
+                continue;
+            }
+
+            if (read(tick_fd, &expirations, sizeof(expirations)) < 0)
+                continue;
+            tick++;
+            if (replaced_by_upgrade()) {
+                log_info("Replaced by an upgrade, leaving the maps to the new l4_lb");
+                exit_code = 0;
+                goto cleanup;
+            }
+            bool sweep_tick = tick % (CONNTRACK_SWEEP_INTERVAL_S / SCORE_INTERVAL_S) == 0;
+            if (sweep_tick)
+                conntrack_sweep(&sweeper, &conntrack);
+            // one snapshot of the counters serves the scores, the reports and the scrapes
+            if (metrics_snapshot(&metrics) == 0) {
+                if (sweep_tick) {
+                    conntrack_report(&sweeper, metrics.cur);
+                    ratelimit_report(&lb_state);
+                }
+                backend_publish_scores(&sweeper, skel, metrics.cur);
+            }
+            if (sweep_tick)
+                lb_state_drain(&lb_state, sweeper.live);
+            flow_log_flush(&flow_log);
+            if (lb_state_slow_start(&lb_state))
+                log_error("Error while growing the share of backends in slow start");
+        }
+
+        /* Only after the events of this wakeup, as a reload may close sockets
+         * that still have events in the batch
+         */
+        if (handover_requested) {
+            handover_requested = 0;
+            if (hand_over()) {
+                log_info("Replaced by an upgrade, leaving the maps to the new l4_lb");
+                exit_code = 0;
+                goto cleanup;
+            }
+        }
+        if (reload_requested) {
+            reload_requested = 0;
+            reload_config(config_file);
+        }
     }
 
 cleanup:
     cleanup_ifaces();
+    if (health.st)
+        health_free(&health);
+    flow_log_free(&flow_log);
+    if (metrics.st)
+        metrics_free(&metrics);
+    lb_state_free(&lb_state);
+    conntrack_free(&conntrack);
     l4_lb_bpf__destroy(skel);
     log_info("Program stopped correctly");
     cyaml_free(&config, &config_schema, conf, 0);
-    return 0;
+    return exit_code;
 }
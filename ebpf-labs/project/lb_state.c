@@ -0,0 +1,695 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lb_state.h"
+#include "log.h"
+#include "maglev.h"
+
+/* Resolution of the weights in the rings, a backend in slow start gets a share
+ * of 1/SLOW_START_STEPS of its weight at least
+ */
+#define SLOW_START_STEPS 100
+
+static __u64 monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *backend_str(const struct backend *be, char *buf, size_t len) {
+    return inet_ntop(be->ipv6 ? AF_INET6 : AF_INET, be->ip6, buf, len);
+}
+
+static int backend_same_addr(const struct backend *a, const struct backend *b) {
+    return a->ipv6 == b->ipv6 && memcmp(a->ip6, b->ip6, sizeof(a->ip6)) == 0;
+}
+
+/* Drained slots are zeroed, down ones still hold a backend that failed its checks */
+static int backend_slot_empty(const struct backend *be) {
+    static const struct backend empty = {};
+
+    return !be->up && !memcmp(be->ip6, empty.ip6, sizeof(be->ip6));
+}
+
+/* Stable identity of a backend for the Maglev permutation */
+static __u64 backend_maglev_key(const struct backend *be) {
+    if (!be->ipv6)
+        return be->ip;
+
+    __u64 hi = ((__u64)be->ip6[0] << 32) | be->ip6[1];
+    __u64 lo = ((__u64)be->ip6[2] << 32) | be->ip6[3];
+    return hi ^ (lo << 31 | lo >> 33);
+}
+
+/* Prepare the outer headers encap_ipv4() and encap_ipv6() copy in front of the
+ * packets to the backend, and the checksum of the IPv4 header.
+ */
+static void backend_build_encap(const struct lb_state *st, struct backend *be) {
+    struct {
+        struct ethhdr eth;
+        struct iphdr ip;
+    } __attribute__((packed)) hdr = {};
+    __u16 words[sizeof(hdr.ip) / 2];
+    __u32 csum = 0;
+
+    _Static_assert(sizeof(hdr) == sizeof(be->encap), "encap template size mismatch");
+
+    memcpy(hdr.eth.h_source, st->src_mac, ETH_ALEN);
+    memcpy(hdr.eth.h_dest, st->gateway_mac, ETH_ALEN);
+    hdr.eth.h_proto = htons(be->ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+    be->reflect_mac = !st->has_gateway_mac;
+
+    if (!be->ipv6) {
+        /* protocol, tot_len, saddr and check stay zero, the encapsulation
+         * stage adds them per packet
+         */
+        hdr.ip.version = 4;
+        hdr.ip.ihl = sizeof(hdr.ip) / 4;
+        hdr.ip.ttl = ENCAP_TTL;
+        hdr.ip.daddr = be->ip;
+
+        memcpy(words, &hdr.ip, sizeof(words));
+        for (int i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+            csum += words[i];
+    }
+
+    be->csum_partial = csum;
+    memcpy(be->encap, &hdr, sizeof(hdr));
+}
+
+static int find_backend_slot(const struct lb_state *st, const struct backend *be) {
+    for (int i = 0; i < MAX_BACKENDS; i++) {
+        if (st->backends[i].in_use && backend_same_addr(&st->backends[i].be, be))
+            return i;
+    }
+
+    return -1;
+}
+
+static int find_service_slot(const struct lb_state *st, const struct service_key *key) {
+    for (__u32 i = 0; i < st->max_services; i++) {
+        if (st->services[i].in_use && !memcmp(&st->services[i].key, key, sizeof(*key)))
+            return i;
+    }
+
+    return -1;
+}
+
+int lb_state_init(struct lb_state *st, struct l4_lb_bpf *skel, __u32 max_services,
+                  __u64 drain_timeout_ns) {
+    memset(st, 0, sizeof(*st));
+    st->skel = skel;
+    st->drain_timeout_ns = drain_timeout_ns;
+    st->max_services = max_services;
+    st->services = calloc(max_services, sizeof(*st->services));
+    st->table = calloc(MAGLEV_TABLE_SIZE, sizeof(*st->table));
+
+    if (!st->services || !st->table) {
+        lb_state_free(st);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void lb_state_free(struct lb_state *st) {
+    for (__u32 i = 0; st->services && i < st->max_services; i++)
+        free(st->services[i].members);
+    free(st->services);
+    free(st->table);
+    st->services = NULL;
+    st->table = NULL;
+}
+
+static struct bpf_program *select_prog(struct l4_lb_bpf *skel, enum lb_policy policy) {
+    switch (policy) {
+    case LB_POLICY_LEAST_CONN:
+        return skel->progs.l4_lb_select_least_conn;
+    default:
+        return skel->progs.l4_lb_select_maglev;
+    }
+}
+
+static struct bpf_program *encap_prog(struct l4_lb_bpf *skel, enum lb_encap encap) {
+    switch (encap) {
+    case LB_ENCAP_FOU:
+        return skel->progs.l4_lb_encap_fou;
+    case LB_ENCAP_GUE:
+        return skel->progs.l4_lb_encap_gue;
+    default:
+        return skel->progs.l4_lb_encap_ipip;
+    }
+}
+
+static int set_stage(struct lb_state *st, __u32 stage, struct bpf_program *prog) {
+    int stages_fd = bpf_map__fd(st->skel->maps.lb_stages);
+    int fd = bpf_program__fd(prog);
+
+    if (bpf_map_update_elem(stages_fd, &stage, &fd, BPF_ANY) != 0) {
+        log_error("Failed to install %s as stage %u: %s", bpf_program__name(prog), stage,
+                  strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void lb_state_set_mtu(struct lb_state *st, __u16 mtu) {
+    st->skel->bss->l4_lb_runtime.mtu = mtu;
+}
+
+void lb_state_set_syn_cookies(struct lb_state *st, bool enable) {
+    st->skel->bss->l4_lb_runtime.syn_cookies = enable;
+}
+
+void lb_state_set_flow_log_sample(struct lb_state *st, __u32 sample) {
+    st->skel->bss->l4_lb_runtime.flow_log_sample = sample;
+}
+
+void lb_state_set_slow_start(struct lb_state *st, __u64 ns) {
+    st->slow_start_ns = ns;
+}
+
+int lb_state_set_pipeline(struct lb_state *st, enum lb_policy policy, enum lb_encap encap,
+                          __u16 port) {
+    /* The port has to be in place before the first packet reaches the new
+     * encapsulation stage. Packets still in the old one don't look at it.
+     */
+    st->skel->bss->l4_lb_runtime.encap_port = htons(port);
+
+    if (set_stage(st, LB_STAGE_SELECT, select_prog(st->skel, policy)) < 0 ||
+        set_stage(st, LB_STAGE_ENCAP, encap_prog(st->skel, encap)) < 0)
+        return -1;
+
+    return 0;
+}
+
+void lb_state_set_next_hop(struct lb_state *st, const __u8 *src, const __u8 *gateway) {
+    memcpy(st->src_mac, src, sizeof(st->src_mac));
+    st->has_gateway_mac = gateway != NULL;
+    if (gateway)
+        memcpy(st->gateway_mac, gateway, sizeof(st->gateway_mac));
+}
+
+/* Map every configured backend to a slot of backend_map, keeping the slot of
+ * the backends that are already loaded. Fails without side effects if there
+ * are not enough free slots.
+ */
+static int assign_backend_slots(struct lb_state *st, const struct lb_backend_conf *backends,
+                                int count, int *slots) {
+    int next_free = 0;
+
+    for (int i = 0; i < count; i++) {
+        slots[i] = find_backend_slot(st, &backends[i].be);
+        for (int j = 0; j < i && slots[i] < 0; j++) {
+            if (backend_same_addr(&backends[j].be, &backends[i].be))
+                slots[i] = slots[j];
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (slots[i] >= 0)
+            continue;
+
+        while (next_free < MAX_BACKENDS && st->backends[next_free].in_use)
+            next_free++;
+        if (next_free == MAX_BACKENDS) {
+            log_error("No free backend slot left, at most %d backends are supported",
+                      MAX_BACKENDS);
+            return -ENOSPC;
+        }
+
+        slots[i] = next_free++;
+        for (int j = i + 1; j < count; j++) {
+            if (backend_same_addr(&backends[j].be, &backends[i].be))
+                slots[j] = slots[i];
+        }
+    }
+
+    return 0;
+}
+
+static int assign_service_slots(struct lb_state *st, const struct lb_service_conf *services,
+                                int count, int *slots) {
+    int next_free = 0;
+
+    for (int i = 0; i < count; i++) {
+        slots[i] = find_service_slot(st, &services[i].key);
+        for (int j = 0; j < i; j++) {
+            if (!memcmp(&services[j].key, &services[i].key, sizeof(services[i].key))) {
+                log_error("Service %d is configured twice", i);
+                return -EINVAL;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (slots[i] >= 0)
+            continue;
+
+        while (next_free < st->max_services && st->services[next_free].in_use)
+            next_free++;
+        if (next_free == st->max_services) {
+            log_error("No free service slot left, the program was loaded for %u services",
+                      st->max_services);
+            return -ENOSPC;
+        }
+        slots[i] = next_free++;
+    }
+
+    return 0;
+}
+
+static void service_reset_drops(struct lb_state *st, __u32 slot) {
+    int ncpus = libbpf_num_possible_cpus();
+
+    if (ncpus <= 0)
+        return;
+
+    __u64 zero[ncpus];
+    memset(zero, 0, sizeof(zero));
+    bpf_map_update_elem(bpf_map__fd(st->skel->maps.ratelimit_drops), &slot, zero, BPF_ANY);
+}
+
+/* Weight of a backend in the rings at `now`. Weights are scaled so that a
+ * backend in slow start can have a fraction of its configured weight.
+ */
+static __u32 backend_ring_weight(const struct lb_state *st, __u32 idx, __u32 weight, __u64 now) {
+    const struct lb_backend_slot *b = &st->backends[idx];
+    __u64 elapsed = now - b->added_ns;
+
+    if (b->unhealthy)
+        return 0;
+    if (weight == 0 || !b->ramping || elapsed >= st->slow_start_ns)
+        return weight * SLOW_START_STEPS;
+
+    __u64 ramp = (__u64)weight * SLOW_START_STEPS * elapsed / st->slow_start_ns;
+    return ramp > 0 ? ramp : 1;
+}
+
+/* Build the ring of a service from its members into the copy the data plane
+ * doesn't use and switch the service over to it.
+ */
+static int service_build(struct lb_state *st, int slot, struct service svc) {
+    struct lb_service_slot *s = &st->services[slot];
+    int maglev_fd = bpf_map__fd(st->skel->maps.maglev_map);
+    int services_fd = bpf_map__fd(st->skel->maps.services_map);
+    struct maglev_backend *ring_backends = calloc(s->members_count + 1, sizeof(*ring_backends));
+    __u64 now = monotonic_ns();
+    int err;
+
+    if (!ring_backends)
+        return -ENOMEM;
+
+    for (int i = 0; i < s->members_count; i++) {
+        ring_backends[i] = s->members[i];
+        ring_backends[i].weight =
+            backend_ring_weight(st, s->members[i].idx, s->members[i].weight, now);
+    }
+
+    svc.gen = s->in_use ? s->svc.gen + 1 : 0;
+    __u32 ring = svc.ring * MAGLEV_RING_COPIES + (svc.gen & 1);
+
+    err = maglev_build(st->table, MAGLEV_TABLE_SIZE, ring_backends, s->members_count);
+    free(ring_backends);
+    if (err)
+        return err;
+    err = maglev_update_map(maglev_fd, ring * MAGLEV_TABLE_SIZE, st->table, MAGLEV_TABLE_SIZE);
+    if (err)
+        return err;
+
+    // a slot taken over from a removed service starts without its drops
+    if (!s->in_use)
+        service_reset_drops(st, slot);
+
+    // the ring is complete, only now let the data plane use it
+    err = bpf_map_update_elem(services_fd, &s->key, &svc, BPF_ANY);
+    if (err)
+        return err;
+
+    log_debug("Service slot %d: %d backends, generation %u", slot, s->members_count, svc.gen);
+    s->svc = svc;
+    s->in_use = 1;
+    return 0;
+}
+
+static int load_service(struct lb_state *st, int slot, const struct lb_service_conf *conf,
+                        const struct lb_backend_conf *backends, const int *backend_slots) {
+    struct lb_service_slot *s = &st->services[slot];
+    struct maglev_backend *members =
+        realloc(s->members, (conf->backends_count + 1) * sizeof(*members));
+
+    if (!members)
+        return -ENOMEM;
+
+    s->members = members;
+    s->members_count = 0;
+    for (int i = 0; i < conf->backends_count; i++) {
+        const struct lb_backend_conf *b = &backends[conf->backends[i]];
+
+        members[s->members_count++] = (struct maglev_backend){
+            .idx = backend_slots[conf->backends[i]],
+            .weight = b->weight,
+            .key = backend_maglev_key(&b->be),
+        };
+    }
+
+    struct service svc = {
+        .ring = slot,
+    };
+    if (conf->rate_limit) {
+        __u32 burst = conf->rate_burst ? conf->rate_burst : conf->rate_limit;
+
+        svc.rate_interval_ns = 1000000000ULL / conf->rate_limit;
+        if (svc.rate_interval_ns == 0)
+            svc.rate_interval_ns = 1;
+        svc.rate_burst_ns = burst * svc.rate_interval_ns;
+    }
+
+    s->key = conf->key;
+    return service_build(st, slot, svc);
+}
+
+/* Rebuild the rings of the services with a member marked in `affected` */
+static int rebuild_services(struct lb_state *st, const char *affected) {
+    int err = 0;
+
+    for (__u32 slot = 0; slot < st->max_services; slot++) {
+        struct lb_service_slot *s = &st->services[slot];
+        int any = 0;
+
+        for (int i = 0; s->in_use && i < s->members_count; i++)
+            any |= affected[s->members[i].idx];
+
+        if (any && service_build(st, slot, s->svc))
+            err = -1;
+    }
+
+    return err;
+}
+
+/* Change the connection cap of a backend in backend_map, keeping its score */
+static int backend_set_max_conns(struct lb_state *st, __u32 idx, __u32 max_conns) {
+    int backend_fd = bpf_map__fd(st->skel->maps.backend_map);
+    struct backend be;
+
+    if (bpf_map_lookup_elem(backend_fd, &idx, &be))
+        return -errno;
+
+    be.max_conns = max_conns;
+    if (bpf_map_update_elem(backend_fd, &idx, &be, BPF_EXIST))
+        return -errno;
+
+    st->backends[idx].be.max_conns = max_conns;
+    return 0;
+}
+
+int lb_state_adopt(struct lb_state *st) {
+    int backend_fd = bpf_map__fd(st->skel->maps.backend_map);
+    int services_fd = bpf_map__fd(st->skel->maps.services_map);
+    struct service_key key, next_key, stale_key;
+    void *prev_key = NULL;
+    char addr[INET6_ADDRSTRLEN];
+    int have_stale = 0;
+    int adopted = 0;
+
+    for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+        struct lb_backend_slot *b = &st->backends[i];
+
+        if (bpf_map_lookup_elem(backend_fd, &i, &b->be) || backend_slot_empty(&b->be))
+            continue;
+
+        // the score carries on, only the outer headers may have changed
+        backend_build_encap(st, &b->be);
+        if (bpf_map_update_elem(backend_fd, &i, &b->be, BPF_EXIST))
+            return -errno;
+
+        b->in_use = 1;
+        b->unhealthy = !b->be.up;
+        b->added_ns = monotonic_ns();
+        adopted++;
+        log_debug("Backend %s adopted in slot %u", backend_str(&b->be, addr, sizeof(addr)), i);
+    }
+
+    while (bpf_map_get_next_key(services_fd, prev_key, &next_key) == 0) {
+        struct service svc;
+
+        // only delete the previous key once we know where to continue from
+        if (have_stale) {
+            bpf_map_delete_elem(services_fd, &stale_key);
+            have_stale = 0;
+        }
+
+        key = next_key;
+        prev_key = &key;
+        if (bpf_map_lookup_elem(services_fd, &key, &svc))
+            continue;
+
+        // left behind by a run with more services, lb_state_apply() can't reach the slot
+        if (svc.ring >= st->max_services || st->services[svc.ring].in_use) {
+            stale_key = key;
+            have_stale = 1;
+            continue;
+        }
+
+        st->services[svc.ring].key = key;
+        st->services[svc.ring].svc = svc;
+        st->services[svc.ring].in_use = 1;
+    }
+
+    if (have_stale)
+        bpf_map_delete_elem(services_fd, &stale_key);
+
+    if (adopted)
+        log_info("Took over %d backends from the pinned maps", adopted);
+    return 0;
+}
+
+int lb_state_apply(struct lb_state *st, const struct lb_backend_conf *backends, int backends_count,
+                   const struct lb_service_conf *services, int services_count) {
+    int backend_fd = bpf_map__fd(st->skel->maps.backend_map);
+    int services_fd = bpf_map__fd(st->skel->maps.services_map);
+    int *backend_slots = calloc(backends_count + 1, sizeof(*backend_slots));
+    int *service_slots = calloc(services_count + 1, sizeof(*service_slots));
+    char *keep = calloc(st->max_services > MAX_BACKENDS ? st->max_services : MAX_BACKENDS, 1);
+    char addr[INET6_ADDRSTRLEN];
+    int warm = 0;
+    int err = -ENOMEM;
+
+    if (!backend_slots || !service_slots || !keep)
+        goto out;
+
+    // the backends of the first config all start cold, none of them needs a slow start
+    for (int i = 0; i < MAX_BACKENDS; i++)
+        warm |= st->backends[i].in_use;
+
+    // check everything before touching the maps
+    for (int s = 0; s < services_count; s++) {
+        for (int i = 0; i < services[s].backends_count; i++) {
+            if (backends[services[s].backends[i]].be.ipv6 != services[s].key.ipv6) {
+                log_error("Service %d has a backend of another address family than its VIP", s);
+                err = -EINVAL;
+                goto out;
+            }
+        }
+    }
+
+    err = assign_backend_slots(st, backends, backends_count, backend_slots);
+    if (!err)
+        err = assign_service_slots(st, services, services_count, service_slots);
+    if (err)
+        goto out;
+
+    // new backends have to be up before any ring points to them
+    for (int i = 0; i < backends_count; i++) {
+        struct lb_backend_slot *b = &st->backends[backend_slots[i]];
+        __u32 idx = backend_slots[i];
+
+        keep[idx] = 1;
+        if (b->in_use) {
+            if (b->draining) {
+                log_info("Backend %s is configured again, stops draining",
+                         backend_str(&b->be, addr, sizeof(addr)));
+                b->draining = 0;
+            }
+            if (b->be.max_conns != backends[i].max_conns) {
+                err = backend_set_max_conns(st, idx, backends[i].max_conns);
+                if (err)
+                    goto out;
+            }
+            continue;
+        }
+
+        /* The slot may have been used by an earlier backend. Its counters carry
+         * on, the active flows it left behind have drained to zero by now.
+         */
+        b->be = backends[i].be;
+        b->be.up = 1;
+        b->be.score = 0;
+        b->be.max_conns = backends[i].max_conns;
+        backend_build_encap(st, &b->be);
+        err = bpf_map_update_elem(backend_fd, &idx, &b->be, BPF_ANY);
+        if (err)
+            goto out;
+        b->in_use = 1;
+        b->unhealthy = 0;
+        b->added_ns = monotonic_ns();
+        b->ramping = warm && st->slow_start_ns > 0;
+        log_info("Backend %s added in slot %u%s", backend_str(&b->be, addr, sizeof(addr)), idx,
+                 b->ramping ? ", starting slowly" : "");
+    }
+
+    for (int s = 0; s < services_count; s++) {
+        err = load_service(st, service_slots[s], &services[s], backends, backend_slots);
+        if (err) {
+            log_error("Error while loading service %d: %s", s, strerror(errno));
+            goto out;
+        }
+    }
+
+    // services that are gone stop matching, their rings are free for reuse
+    memset(keep, 0, st->max_services);
+    for (int s = 0; s < services_count; s++)
+        keep[service_slots[s]] = 1;
+    for (__u32 i = 0; i < st->max_services; i++) {
+        if (!st->services[i].in_use || keep[i])
+            continue;
+
+        bpf_map_delete_elem(services_fd, &st->services[i].key);
+        st->services[i].in_use = 0;
+        st->services[i].members_count = 0;
+        log_info("Service slot %u removed", i);
+    }
+
+    // no ring points to removed backends anymore, let their flows drain
+    memset(keep, 0, MAX_BACKENDS);
+    for (int i = 0; i < backends_count; i++)
+        keep[backend_slots[i]] = 1;
+    for (int i = 0; i < MAX_BACKENDS; i++) {
+        struct lb_backend_slot *b = &st->backends[i];
+
+        if (!b->in_use || b->draining || keep[i])
+            continue;
+
+        b->draining = 1;
+        b->drain_deadline_ns = monotonic_ns() + st->drain_timeout_ns;
+        log_info("Backend %s removed, draining its flows",
+                 backend_str(&b->be, addr, sizeof(addr)));
+    }
+
+    err = 0;
+out:
+    free(backend_slots);
+    free(service_slots);
+    free(keep);
+    return err;
+}
+
+int lb_state_slow_start(struct lb_state *st) {
+    char ramping[MAX_BACKENDS] = {};
+    char addr[INET6_ADDRSTRLEN];
+    __u64 now = monotonic_ns();
+    int any = 0;
+
+    for (int i = 0; i < MAX_BACKENDS; i++) {
+        struct lb_backend_slot *b = &st->backends[i];
+
+        if (!b->in_use || !b->ramping)
+            continue;
+
+        // rebuild once more at full weight, then the backend is done
+        ramping[i] = 1;
+        any = 1;
+        if (now - b->added_ns >= st->slow_start_ns) {
+            b->ramping = 0;
+            log_info("Backend %s reached its full weight", backend_str(&b->be, addr, sizeof(addr)));
+        }
+    }
+
+    return any ? rebuild_services(st, ramping) : 0;
+}
+
+/* Mark a backend up or down in backend_map, keeping its score */
+static int backend_set_up(struct lb_state *st, __u32 idx, __u8 up) {
+    int backend_fd = bpf_map__fd(st->skel->maps.backend_map);
+    struct backend be;
+
+    if (bpf_map_lookup_elem(backend_fd, &idx, &be))
+        return -errno;
+
+    be.up = up;
+    if (bpf_map_update_elem(backend_fd, &idx, &be, BPF_EXIST))
+        return -errno;
+
+    st->backends[idx].be.up = up;
+    return 0;
+}
+
+int lb_state_set_backend_health(struct lb_state *st, __u32 idx, bool healthy) {
+    struct lb_backend_slot *b = &st->backends[idx];
+    char affected[MAX_BACKENDS] = {};
+    char addr[INET6_ADDRSTRLEN];
+    int err;
+
+    if (!b->in_use || b->unhealthy == !healthy)
+        return 0;
+
+    affected[idx] = 1;
+    b->unhealthy = !healthy;
+    if (!healthy) {
+        // no new flows first, then move the existing ones over to the rings without it
+        err = rebuild_services(st, affected);
+        if (!err)
+            err = backend_set_up(st, idx, 0);
+        log_warn("Backend %s is down", backend_str(&b->be, addr, sizeof(addr)));
+        return err;
+    }
+
+    b->added_ns = monotonic_ns();
+    b->ramping = st->slow_start_ns > 0;
+    err = backend_set_up(st, idx, 1);
+    if (!err)
+        err = rebuild_services(st, affected);
+    log_info("Backend %s is up again%s", backend_str(&b->be, addr, sizeof(addr)),
+             b->ramping ? ", starting slowly" : "");
+    return err;
+}
+
+void lb_state_drain(struct lb_state *st, const __u64 *live) {
+    int backend_fd = bpf_map__fd(st->skel->maps.backend_map);
+    char addr[INET6_ADDRSTRLEN];
+    __u64 now = monotonic_ns();
+
+    for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+        struct lb_backend_slot *b = &st->backends[i];
+
+        if (!b->in_use || !b->draining)
+            continue;
+
+        if (live[i] > 0 && now < b->drain_deadline_ns) {
+            log_debug("Backend %s still has %llu flows",
+                      backend_str(&b->be, addr, sizeof(addr)), live[i]);
+            continue;
+        }
+
+        // flows that are still pinned to the slot get reassigned by the data plane
+        struct backend down = {};
+        if (bpf_map_update_elem(backend_fd, &i, &down, BPF_ANY))
+            continue;
+
+        log_info("Backend %s drained with %llu flows left", backend_str(&b->be, addr, sizeof(addr)),
+                 live[i]);
+        b->in_use = 0;
+        b->draining = 0;
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef LB_STATE_H_
+#define LB_STATE_H_
+
+#include "ebpf/l4_lb_common.h"
+#include "l4_lb.skel.h"
+#include "maglev.h"
+
+/* A backend as requested by the config */
+struct lb_backend_conf {
+    struct backend be; /* address of the backend, the rest is filled in by lb_state */
+    __u32 weight;      /* relative share of the Maglev rings, 0 takes no new flows */
+    __u32 max_conns;   /* active connections at which it takes no new flows, 0 for no cap */
+};
+
+/* A service as requested by the config */
+struct lb_service_conf {
+    struct service_key key;
+    const int *backends; /* indexes into the backends of the same config */
+    int backends_count;
+    __u32 rate_limit; /* packets per second per client, 0 for no limit */
+    __u32 rate_burst; /* packets a client may send at once, 0 for one second's worth */
+};
+
+/* What the control plane put into backend_map */
+struct lb_backend_slot {
+    struct backend be;
+    __u8 in_use;    /* the slot holds a backend in backend_map */
+    __u8 draining;  /* removed from the config, waiting for its flows to end */
+    __u8 ramping;   /* added at runtime, its share of the rings still grows */
+    __u8 unhealthy; /* failed its health checks, out of the rings and down in backend_map */
+    __u64 drain_deadline_ns;
+    __u64 added_ns; /* when the backend was added, the start of its slow start */
+};
+
+/* What the control plane put into services_map */
+struct lb_service_slot {
+    struct service_key key;
+    struct service svc;
+    __u8 in_use;
+    /* Backends of the ring with their configured weights, kept to rebuild the
+     * ring while backends are in slow start
+     */
+    struct maglev_backend *members;
+    int members_count;
+};
+
+/* Backends and services currently loaded into the maps. Backends keep their
+ * slot in backend_map, and so their flows and counters, for as long as they
+ * are configured.
+ */
+struct lb_state {
+    struct l4_lb_bpf *skel;
+    __u64 drain_timeout_ns;
+    __u64 slow_start_ns; /* time a new backend takes to reach its full weight, 0 for none */
+    struct lb_backend_slot backends[MAX_BACKENDS];
+    struct lb_service_slot *services;
+    __u32 max_services; /* number of services maglev_map has rings for */
+    __u32 *table;       /* scratch space to build a Maglev ring */
+    __u8 src_mac[6];    /* MAC addresses of the outer Ethernet header */
+    __u8 gateway_mac[6];
+    __u8 has_gateway_mac;
+};
+
+/* Number of maglev_map entries needed for `max_services` services */
+static inline __u32 lb_state_maglev_entries(__u32 max_services) {
+    return max_services * MAGLEV_RING_COPIES * MAGLEV_TABLE_SIZE;
+}
+
+int lb_state_init(struct lb_state *st, struct l4_lb_bpf *skel, __u32 max_services,
+                  __u64 drain_timeout_ns);
+void lb_state_free(struct lb_state *st);
+
+/* Fill the lb_stages program array with the stages for `policy` and `encap`,
+ * with `port` as destination port of FOU and GUE. Replacing the stages of a
+ * running program takes effect with the next packet.
+ */
+int lb_state_set_pipeline(struct lb_state *st, enum lb_policy policy, enum lb_encap encap,
+                          __u16 port);
+
+/* Set the MTU of the path to the backends. Packets that exceed it once
+ * encapsulated are answered with an ICMP error that makes the client send
+ * smaller ones.
+ */
+void lb_state_set_mtu(struct lb_state *st, __u16 mtu);
+
+/* Answer the SYNs of clients that haven't proven their address yet with a
+ * SYN cookie, so that a SYN flood doesn't create any state.
+ */
+void lb_state_set_syn_cookies(struct lb_state *st, bool enable);
+
+/* Send the new-flow and flow-end events of 1 in `sample` flows to the
+ * flow_events ring buffer, 0 for none. Flows are sampled when they start.
+ */
+void lb_state_set_flow_log_sample(struct lb_state *st, __u32 sample);
+
+/* Let backends added from now on start with a small share of the Maglev
+ * rings that grows to their full weight over `ns`, so that a cold backend
+ * doesn't receive all the new flows at once. 0 adds them at full weight.
+ */
+void lb_state_set_slow_start(struct lb_state *st, __u64 ns);
+
+/* Set the MAC addresses of the outer Ethernet header for backends added from
+ * now on. Without a `gateway` the packets are sent back to the MAC address
+ * they came from.
+ */
+void lb_state_set_next_hop(struct lb_state *st, const __u8 *src, const __u8 *gateway);
+
+/* Take over the backends and services a previous run left in reused pinned
+ * maps, so that backends keep the slots their flows point to. The encap
+ * templates are rebuilt for the current next hop. Call before the first
+ * lb_state_apply(), which then drains what is no longer configured.
+ */
+int lb_state_adopt(struct lb_state *st);
+
+/* Bring the maps in line with the given backends and services without
+ * disturbing the flows of the backends that stay. Backends that are no longer
+ * configured are taken out of the Maglev rings and drain. A config that is
+ * invalid or doesn't fit the slots changes nothing. If writing a map fails
+ * midway, the maps keep what was written so far, which is consistent with
+ * lb_state, and the next apply finishes the job.
+ */
+int lb_state_apply(struct lb_state *st, const struct lb_backend_conf *backends, int backends_count,
+                   const struct lb_service_conf *services, int services_count);
+
+/* Rebuild the rings of the services with backends in slow start with the
+ * weights they have by now. Called periodically, does nothing once all
+ * backends are at full weight.
+ */
+int lb_state_slow_start(struct lb_state *st);
+
+/* Take a backend that failed its health checks out of the rings and mark it
+ * down, so that the data plane moves its flows to other backends, or bring it
+ * back once it recovered. A backend that comes back starts slowly like a new
+ * one.
+ */
+int lb_state_set_backend_health(struct lb_state *st, __u32 idx, bool healthy);
+
+/* Free the slots of draining backends that have no live flows left, as counted
+ * per backend slot in `live`, or whose drain timeout passed.
+ */
+void lb_state_drain(struct lb_state *st, const __u64 *live);
+
+#endif // LB_STATE_H_
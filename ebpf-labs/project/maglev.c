@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#include <bpf/bpf.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebpf/l4_lb_common.h"
+#include "log.h"
+#include "maglev.h"
+
+#define MAGLEV_OFFSET_SEED 0x9e3779b97f4a7c15ULL
+#define MAGLEV_SKIP_SEED 0xc2b2ae3d27d4eb4fULL
+
+/* 64 bit finalizer of MurmurHash3 */
+static __u64 maglev_hash(__u64 key, __u64 seed) {
+    __u64 h = key ^ seed;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+int maglev_build(__u32 *table, __u32 size, const struct maglev_backend *backends, int count) {
+    __u32 *offset = calloc(count, sizeof(*offset));
+    __u32 *skip = calloc(count, sizeof(*skip));
+    __u32 *next = calloc(count, sizeof(*next));
+    __u32 *credit = calloc(count, sizeof(*credit));
+    __u32 max_weight = 0;
+    __u32 filled = 0;
+    int err = 0;
+
+    for (__u32 i = 0; i < size; i++)
+        table[i] = MAGLEV_NO_BACKEND;
+
+    if (!offset || !skip || !next || !credit) {
+        log_error("Out of memory while building the Maglev table");
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (int i = 0; i < count; i++) {
+        offset[i] = maglev_hash(backends[i].key, MAGLEV_OFFSET_SEED) % size;
+        skip[i] = maglev_hash(backends[i].key, MAGLEV_SKIP_SEED) % (size - 1) + 1;
+        if (backends[i].weight > max_weight)
+            max_weight = backends[i].weight;
+    }
+
+    if (max_weight == 0)
+        goto out;
+
+    /* Every round each backend earns its weight in credit and claims the next
+     * free slot of its permutation whenever it has saved up max_weight. With
+     * equal weights this is the plain Maglev population.
+     */
+    while (filled < size) {
+        for (int i = 0; i < count && filled < size; i++) {
+            credit[i] += backends[i].weight;
+            if (credit[i] < max_weight)
+                continue;
+            credit[i] -= max_weight;
+
+            __u32 slot;
+            do {
+                slot = (offset[i] + (__u64)next[i] * skip[i]) % size;
+                next[i]++;
+            } while (table[slot] != MAGLEV_NO_BACKEND);
+
+            table[slot] = backends[i].idx;
+            filled++;
+        }
+    }
+
+out:
+    free(offset);
+    free(skip);
+    free(next);
+    free(credit);
+    return err;
+}
+
+int maglev_update_map(int map_fd, __u32 first_slot, const __u32 *table, __u32 size) {
+    __u32 *keys = malloc(size * sizeof(*keys));
+    __u32 count = size;
+    int err;
+
+    if (!keys)
+        return -ENOMEM;
+
+    for (__u32 i = 0; i < size; i++)
+        keys[i] = first_slot + i;
+
+    err = bpf_map_update_batch(map_fd, keys, table, &count, NULL);
+    if (err) {
+        // batch operations need a 5.6+ kernel, fall back to one update per slot
+        log_debug("Batch update of the Maglev table failed (%s), updating slot by slot",
+                  strerror(errno));
+        err = 0;
+        for (__u32 i = 0; i < size && !err; i++)
+            err = bpf_map_update_elem(map_fd, &keys[i], &table[i], BPF_ANY);
+    }
+
+    free(keys);
+    return err;
+}
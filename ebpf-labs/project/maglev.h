@@ -0,0 +1,25 @@
+#ifndef MAGLEV_H_
+#define MAGLEV_H_
+
+#include <linux/types.h>
+
+/* A backend as seen by the Maglev table builder */
+struct maglev_backend {
+    __u32 idx;    /* value stored in the table, index into backend_map */
+    __u32 weight; /* relative share of the table, 0 takes no slots */
+    __u64 key;    /* stable identity of the backend, e.g. its address */
+};
+
+/* Fill `table` (of `size` slots, a prime) with the indexes of `backends`.
+ * Slots are distributed according to the backend weights, and a backend keeps
+ * most of its slots when other backends are added or removed. If no backend
+ * has a weight the table is filled with MAGLEV_NO_BACKEND. Returns -ENOMEM,
+ * with a table that must not be installed, if the scratch space can't be
+ * allocated.
+ */
+int maglev_build(__u32 *table, __u32 size, const struct maglev_backend *backends, int count);
+
+/* Write the table into the BPF array map behind `map_fd`, starting at `first_slot` */
+int maglev_update_map(int map_fd, __u32 first_slot, const __u32 *table, __u32 size);
+
+#endif // MAGLEV_H_
@@ -0,0 +1,572 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+#define _GNU_SOURCE /* accept4() */
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lb_state.h"
+#include "log.h"
+#include "metrics.h"
+
+/* How long a client may take to send its request and read the page */
+#define METRICS_CLIENT_TIMEOUT_NS (5 * 1000000000ULL)
+
+/* Names of the lb_stats counters in the events metrics */
+static const char *const lb_stat_names[] = {
+    [LB_STAT_FLOWS_CREATED] = "flows_created",
+    [LB_STAT_FLOWS_EXPIRED] = "flows_expired",
+    [LB_STAT_CONNTRACK_FULL] = "conntrack_full",
+    [LB_STAT_FLOWS_CLOSED] = "flows_closed",
+    [LB_STAT_FLOWS_RESET] = "flows_reset",
+    [LB_STAT_TCP_NO_STATE] = "tcp_no_state",
+    [LB_STAT_FLOWS_REASSIGNED] = "flows_reassigned",
+    [LB_STAT_FIB_FAILED] = "fib_failed",
+    [LB_STAT_TAIL_CALL_FAILED] = "tail_call_failed",
+    [LB_STAT_FRAGMENTS] = "fragments",
+    [LB_STAT_FRAG_UNKNOWN] = "frag_unknown",
+    [LB_STAT_ICMP_TOO_BIG] = "icmp_too_big",
+    [LB_STAT_RX_HASH_MISSING] = "rx_hash_missing",
+    [LB_STAT_SYN_CHALLENGED] = "syn_challenged",
+    [LB_STAT_SYN_VERIFIED] = "syn_verified",
+    [LB_STAT_BACKEND_FULL] = "backend_full",
+    [LB_STAT_FLOW_EVENTS_LOST] = "flow_events_lost",
+    [LB_STAT_ENCAP_FAILED] = "encap_failed",
+};
+
+_Static_assert(sizeof(lb_stat_names) / sizeof(lb_stat_names[0]) == LB_STAT_MAX,
+               "every lb_stat needs a name");
+
+/* Per-backend series, one line per configured backend */
+enum backend_metric {
+    BACKEND_UP,
+    BACKEND_DRAINING,
+    BACKEND_ACTIVE_FLOWS,
+    BACKEND_FLOWS,
+    BACKEND_PACKETS,
+    BACKEND_FLOWS_RATE,
+    BACKEND_PACKETS_RATE,
+    BACKEND_METRIC_MAX,
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} backend_metrics[] = {
+    [BACKEND_UP] = {"l4_lb_backend_up", "gauge", "Whether the backend takes flows"},
+    [BACKEND_DRAINING] = {"l4_lb_backend_draining", "gauge",
+                          "Whether the backend was removed and waits for its flows to end"},
+    [BACKEND_ACTIVE_FLOWS] = {"l4_lb_backend_active_flows", "gauge",
+                              "Active flows of the backend as last published to the data plane"},
+    [BACKEND_FLOWS] = {"l4_lb_backend_flows_total", "counter",
+                       "Flows ever assigned to the backend"},
+    [BACKEND_PACKETS] = {"l4_lb_backend_packets_total", "counter",
+                         "Packets forwarded to the backend"},
+    [BACKEND_FLOWS_RATE] = {"l4_lb_backend_flows_per_second", "gauge",
+                            "New flows per second between the last two snapshots"},
+    [BACKEND_PACKETS_RATE] = {"l4_lb_backend_packets_per_second", "gauge",
+                              "Packets per second between the last two snapshots"},
+};
+
+_Static_assert(sizeof(backend_metrics) / sizeof(backend_metrics[0]) == BACKEND_METRIC_MAX,
+               "every backend metric needs a name");
+
+static __u64 monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Change of a counter per second between two snapshots. A counter that went
+ * backwards belongs to a slot that was reused and has no rate yet.
+ */
+static double rate(__u64 cur, __u64 prev, double interval_s) {
+    return interval_s > 0 && cur >= prev ? (cur - prev) / interval_s : 0;
+}
+
+/* Read all `max` entries of an array map with as few syscalls as the kernel
+ * allows. The values of per-CPU maps come with one copy per CPU, each
+ * `value_size` bytes. Returns the number of entries read or a negative error.
+ */
+static int lookup_batch(struct metrics *m, int fd, __u32 max, size_t value_size) {
+    __u32 token, total = 0;
+    void *in_batch = NULL;
+
+    while (total < max) {
+        __u32 count = max - total;
+        int err = bpf_map_lookup_batch(fd, in_batch, &token, m->keys + total,
+                                       (char *)m->values + total * value_size, &count, NULL);
+
+        m->snapshot_syscalls++;
+        total += count;
+        // the end of the map is reported together with the last entries
+        if (err)
+            return errno == ENOENT ? (int)total : -errno;
+        in_batch = &token;
+    }
+
+    return total;
+}
+
+static int snapshot_backends(struct metrics *m, struct metrics_sample *sample) {
+    int fd = bpf_map__fd(m->st->skel->maps.backend_map);
+    int n = lookup_batch(m, fd, MAX_BACKENDS, sizeof(struct backend));
+    const struct backend *values = m->values;
+
+    for (int i = 0; i < n; i++) {
+        if (m->keys[i] < MAX_BACKENDS)
+            sample->backends[m->keys[i]] = values[i];
+    }
+
+    return n < 0 ? n : 0;
+}
+
+static int snapshot_backend_stats(struct metrics *m, struct metrics_sample *sample) {
+    int fd = bpf_map__fd(m->st->skel->maps.backend_stats);
+    int n = lookup_batch(m, fd, MAX_BACKENDS, m->ncpus * sizeof(struct backend_stats));
+    const struct backend_stats *values = m->values;
+
+    for (int i = 0; i < n; i++) {
+        struct backend_stats *sum;
+
+        if (m->keys[i] >= MAX_BACKENDS)
+            continue;
+
+        sum = &sample->stats[m->keys[i]];
+        memset(sum, 0, sizeof(*sum));
+        for (int cpu = 0; cpu < m->ncpus; cpu++) {
+            const struct backend_stats *v = &values[i * m->ncpus + cpu];
+
+            sum->num_flows += v->num_flows;
+            sum->num_packets += v->num_packets;
+            sum->active_flows += v->active_flows;
+        }
+    }
+
+    return n < 0 ? n : 0;
+}
+
+static int snapshot_lb_stats(struct metrics *m, struct metrics_sample *sample) {
+    int fd = bpf_map__fd(m->st->skel->maps.lb_stats);
+    int n = lookup_batch(m, fd, LB_STAT_MAX, m->ncpus * sizeof(__u64));
+    const __u64 *values = m->values;
+
+    for (int i = 0; i < n; i++) {
+        if (m->keys[i] >= LB_STAT_MAX)
+            continue;
+
+        sample->lb_stats[m->keys[i]] = 0;
+        for (int cpu = 0; cpu < m->ncpus; cpu++)
+            sample->lb_stats[m->keys[i]] += values[i * m->ncpus + cpu];
+    }
+
+    return n < 0 ? n : 0;
+}
+
+static void client_close(struct metrics_client *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->resp);
+    c->fd = -1;
+    c->req_len = 0;
+    c->resp = NULL;
+    c->resp_len = c->resp_off = 0;
+}
+
+int metrics_snapshot(struct metrics *m) {
+    struct metrics_sample *sample = m->next;
+    __u64 start = monotonic_ns();
+    int err;
+
+    m->snapshot_syscalls = 0;
+    err = snapshot_backends(m, sample);
+    if (!err)
+        err = snapshot_backend_stats(m, sample);
+    if (!err)
+        err = snapshot_lb_stats(m, sample);
+
+    __u64 end = monotonic_ns();
+    m->snapshot_ns = end - start;
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        struct metrics_client *c = &m->clients[i];
+
+        if (c->fd >= 0 && end - c->accepted_ns > METRICS_CLIENT_TIMEOUT_NS)
+            client_close(c);
+    }
+
+    if (err) {
+        log_error("Failed to read the counters of the data plane: %s", strerror(-err));
+        return err;
+    }
+
+    // the rates are taken over the time the maps were read
+    sample->time_ns = start + m->snapshot_ns / 2;
+    m->next = m->prev;
+    m->prev = m->cur;
+    m->cur = sample;
+    m->snapshots++;
+    return 0;
+}
+
+void metrics_set_conntrack(struct metrics *m, __u64 flows, __u32 max_flows, __u64 swept,
+                           __u64 sweep_ns, __u32 sweep_syscalls) {
+    m->ct_flows = flows;
+    m->ct_max_flows = max_flows;
+    m->ct_swept = swept;
+    m->ct_sweep_ns = sweep_ns;
+    m->ct_sweep_syscalls = sweep_syscalls;
+}
+
+static void render_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void render_metric(FILE *out, const char *name, const char *type, const char *help,
+                          double value) {
+    render_header(out, name, type, help);
+    fprintf(out, "%s %.15g\n", name, value);
+}
+
+static double backend_value(const struct metrics *m, __u32 idx, enum backend_metric metric,
+                            double interval_s) {
+    const struct backend_stats *cur = &m->cur->stats[idx];
+    const struct backend_stats *prev = &m->prev->stats[idx];
+
+    switch (metric) {
+    case BACKEND_UP:
+        return m->cur->backends[idx].up;
+    case BACKEND_DRAINING:
+        return m->st->backends[idx].draining;
+    case BACKEND_ACTIVE_FLOWS:
+        return m->cur->backends[idx].score;
+    case BACKEND_FLOWS:
+        return cur->num_flows;
+    case BACKEND_PACKETS:
+        return cur->num_packets;
+    case BACKEND_FLOWS_RATE:
+        return rate(cur->num_flows, prev->num_flows, interval_s);
+    case BACKEND_PACKETS_RATE:
+        return rate(cur->num_packets, prev->num_packets, interval_s);
+    default:
+        return 0;
+    }
+}
+
+/* Write the last snapshot in the Prometheus text format */
+static void metrics_render(struct metrics *m, FILE *out) {
+    double interval_s = 0;
+    char addr[INET6_ADDRSTRLEN];
+
+    // rates need two snapshots
+    if (m->snapshots > 1)
+        interval_s = (m->cur->time_ns - m->prev->time_ns) / 1e9;
+
+    for (int metric = 0; metric < BACKEND_METRIC_MAX; metric++) {
+        render_header(out, backend_metrics[metric].name, backend_metrics[metric].type,
+                      backend_metrics[metric].help);
+
+        for (__u32 i = 0; i < MAX_BACKENDS; i++) {
+            const struct lb_backend_slot *slot = &m->st->backends[i];
+
+            if (!slot->in_use)
+                continue;
+
+            inet_ntop(slot->be.ipv6 ? AF_INET6 : AF_INET, slot->be.ip6, addr, sizeof(addr));
+            fprintf(out, "%s{backend=\"%s\"} %.15g\n", backend_metrics[metric].name, addr,
+                    backend_value(m, i, metric, interval_s));
+        }
+    }
+
+    render_header(out, "l4_lb_events_total", "counter",
+                  "Events counted by the data plane");
+    for (int i = 0; i < LB_STAT_MAX; i++)
+        fprintf(out, "l4_lb_events_total{event=\"%s\"} %llu\n", lb_stat_names[i],
+                m->cur->lb_stats[i]);
+
+    render_header(out, "l4_lb_events_per_second", "gauge",
+                  "Events per second between the last two snapshots");
+    for (int i = 0; i < LB_STAT_MAX; i++)
+        fprintf(out, "l4_lb_events_per_second{event=\"%s\"} %.15g\n", lb_stat_names[i],
+                rate(m->cur->lb_stats[i], m->prev->lb_stats[i], interval_s));
+
+    render_metric(out, "l4_lb_conntrack_flows", "gauge",
+                  "Flows the last sweep left in the connection table", m->ct_flows);
+    render_metric(out, "l4_lb_conntrack_max_flows", "gauge", "Size of the connection table",
+                  m->ct_max_flows);
+    render_metric(out, "l4_lb_conntrack_swept_total", "counter",
+                  "Idle flows deleted by the control plane", m->ct_swept);
+    render_metric(out, "l4_lb_conntrack_sweep_seconds", "gauge",
+                  "Time the last sweep of the connection table took", m->ct_sweep_ns / 1e9);
+    render_metric(out, "l4_lb_conntrack_sweep_syscalls", "gauge",
+                  "bpf() calls the last sweep of the connection table took", m->ct_sweep_syscalls);
+
+    render_metric(out, "l4_lb_snapshots_total", "counter",
+                  "Snapshots taken of the counters of the data plane", m->snapshots);
+    render_metric(out, "l4_lb_snapshot_seconds", "gauge", "Time the last snapshot took",
+                  m->snapshot_ns / 1e9);
+    render_metric(out, "l4_lb_snapshot_syscalls", "gauge", "bpf() calls the last snapshot took",
+                  m->snapshot_syscalls);
+    render_metric(out, "l4_lb_scrapes_total", "counter", "Requests served by this endpoint",
+                  m->scrapes);
+    render_metric(out, "l4_lb_scrape_render_seconds", "gauge",
+                  "Time the previous page took to render", m->render_ns / 1e9);
+}
+
+/* Build the whole response, the client is closed once it has been sent */
+static void client_respond(struct metrics_client *c, const char *status, const char *body,
+                           size_t body_len) {
+    FILE *out = open_memstream(&c->resp, &c->resp_len);
+
+    if (!out)
+        return;
+
+    fprintf(out,
+            "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+            status, body_len);
+    fwrite(body, 1, body_len, out);
+    fclose(out);
+}
+
+static void client_serve(struct metrics_client *c) {
+    struct metrics *m = c->m;
+    char method[8], path[256];
+    char *body = NULL;
+    size_t body_len = 0;
+
+    if (sscanf(c->req, "%7s %255s", method, path) != 2) {
+        client_respond(c, "400 Bad Request", "bad request\n", 12);
+        return;
+    }
+    if (strcmp(method, "GET")) {
+        client_respond(c, "405 Method Not Allowed", "only GET is supported\n", 22);
+        return;
+    }
+    if (strcmp(path, "/metrics") && strncmp(path, "/metrics?", 9)) {
+        client_respond(c, "404 Not Found", "the metrics are at /metrics\n", 28);
+        return;
+    }
+
+    __u64 start = monotonic_ns();
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out)
+        return;
+    metrics_render(m, out);
+    fclose(out);
+    m->render_ns = monotonic_ns() - start;
+    m->scrapes++;
+
+    client_respond(c, "200 OK", body, body_len);
+    free(body);
+}
+
+/* Send what the socket takes, returns whether the client is done */
+static bool client_send(struct metrics_client *c) {
+    while (c->resp_off < c->resp_len) {
+        ssize_t n = send(c->fd, c->resp + c->resp_off, c->resp_len - c->resp_off, MSG_NOSIGNAL);
+
+        if (n < 0)
+            return errno != EAGAIN && errno != EINTR;
+        c->resp_off += n;
+    }
+
+    return true;
+}
+
+static void client_event(void *ctx, __u32 events) {
+    struct metrics_client *c = ctx;
+
+    // the client may have timed out earlier in the same batch of events
+    if (c->fd < 0)
+        return;
+
+    if (!c->resp) {
+        ssize_t n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) {
+            client_close(c);
+            return;
+        }
+
+        c->req_len += n;
+        c->req[c->req_len] = 0;
+        // only the request line matters, but wait for the whole header
+        if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+            if (c->req_len == sizeof(c->req) - 1)
+                client_respond(c, "431 Request Header Fields Too Large", "request too large\n",
+                               18);
+            else
+                return;
+        } else {
+            client_serve(c);
+        }
+
+        if (!c->resp) {
+            client_close(c);
+            return;
+        }
+    }
+
+    if (client_send(c)) {
+        client_close(c);
+        return;
+    }
+
+    if (!(events & EPOLLOUT) && event_loop_modify(c->m->epoll_fd, c->fd, EPOLLOUT, &c->src))
+        client_close(c);
+}
+
+static void listen_event(void *ctx, __u32 events) {
+    struct metrics *m = ctx;
+
+    for (;;) {
+        int fd = accept4(m->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        struct metrics_client *c = NULL;
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                log_error("Failed to accept a metrics client: %s", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            if (m->clients[i].fd < 0) {
+                c = &m->clients[i];
+                break;
+            }
+        }
+
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->accepted_ns = monotonic_ns();
+        if (event_loop_add(m->epoll_fd, fd, EPOLLIN, &c->src))
+            client_close(c);
+    }
+}
+
+int metrics_init(struct metrics *m, struct lb_state *st, int epoll_fd) {
+    size_t values_size;
+
+    memset(m, 0, sizeof(*m));
+    m->st = st;
+    m->epoll_fd = epoll_fd;
+    m->listen_fd = -1;
+    m->listen = (struct event_source){.handle = listen_event, .ctx = m};
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        struct metrics_client *c = &m->clients[i];
+
+        c->src = (struct event_source){.handle = client_event, .ctx = c};
+        c->m = m;
+        c->fd = -1;
+    }
+
+    m->ncpus = libbpf_num_possible_cpus();
+    if (m->ncpus <= 0)
+        return m->ncpus ? m->ncpus : -EINVAL;
+
+    // backend_stats has the largest values, one per CPU
+    values_size = MAX_BACKENDS * m->ncpus * sizeof(struct backend_stats);
+    if (values_size < MAX_BACKENDS * sizeof(struct backend))
+        values_size = MAX_BACKENDS * sizeof(struct backend);
+
+    m->cur = calloc(1, sizeof(*m->cur));
+    m->prev = calloc(1, sizeof(*m->prev));
+    m->next = calloc(1, sizeof(*m->next));
+    m->keys = calloc(MAX_BACKENDS, sizeof(*m->keys));
+    m->values = malloc(values_size);
+    if (!m->cur || !m->prev || !m->next || !m->keys || !m->values) {
+        metrics_free(m);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void metrics_free(struct metrics *m) {
+    metrics_listen(m, NULL, 0);
+    free(m->cur);
+    free(m->prev);
+    free(m->next);
+    free(m->keys);
+    free(m->values);
+    m->cur = m->prev = m->next = NULL;
+    m->keys = NULL;
+    m->values = NULL;
+}
+
+int metrics_listen(struct metrics *m, const char *addr, __u16 port) {
+    struct sockaddr_storage sa = {};
+    socklen_t sa_len;
+    int one = 1;
+    int fd;
+
+    if (m->listen_fd >= 0 && addr && port == m->listen_port && !strcmp(addr, m->listen_addr))
+        return 0;
+
+    if (m->listen_fd >= 0) {
+        close(m->listen_fd);
+        log_info("Stopped serving the metrics on %s port %u", m->listen_addr, m->listen_port);
+    }
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++)
+        client_close(&m->clients[i]);
+    m->listen_fd = -1;
+    m->listen_addr[0] = 0;
+    m->listen_port = 0;
+
+    if (!addr || !port)
+        return 0;
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+    if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        sa_len = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sa_len = sizeof(*sin6);
+    } else {
+        log_error("Failed to convert the metrics address %s to an IPv4 or IPv6 address", addr);
+        return -EINVAL;
+    }
+
+    fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr *)&sa, sa_len) || listen(fd, METRICS_MAX_CLIENTS)) {
+        int err = -errno;
+
+        log_error("Failed to serve the metrics on %s port %u: %s", addr, port, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return err;
+    }
+
+    int err = event_loop_add(m->epoll_fd, fd, EPOLLIN, &m->listen);
+    if (err) {
+        close(fd);
+        return err;
+    }
+
+    m->listen_fd = fd;
+    snprintf(m->listen_addr, sizeof(m->listen_addr), "%s", addr);
+    m->listen_port = port;
+    log_info("Serving the metrics on %s port %u", addr, port);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <netinet/in.h>
+#include <stddef.h>
+
+#include "ebpf/l4_lb_common.h"
+#include "event_loop.h"
+
+struct lb_state;
+
+/* Scrapes served at once, further connections are closed right away */
+#define METRICS_MAX_CLIENTS 16
+
+/* The counters of the data plane at one point in time */
+struct metrics_sample {
+    __u64 time_ns; /* monotonic clock */
+    struct backend backends[MAX_BACKENDS];
+    struct backend_stats stats[MAX_BACKENDS]; /* summed over all CPUs */
+    __u64 lb_stats[LB_STAT_MAX];              /* summed over all CPUs */
+};
+
+/* A connection to the metrics endpoint */
+struct metrics_client {
+    struct event_source src;
+    struct metrics *m;
+    int fd; /* -1 for a free slot */
+    __u64 accepted_ns;
+    char req[1024];
+    size_t req_len;
+    char *resp;
+    size_t resp_len;
+    size_t resp_off;
+};
+
+/* Snapshots of backend_map, backend_stats and lb_stats taken with batched
+ * lookups, and an HTTP endpoint that serves them in the Prometheus text
+ * format together with the rates between the last two snapshots
+ */
+struct metrics {
+    struct lb_state *st;
+    int epoll_fd;
+    int ncpus;
+    struct metrics_sample *cur;  /* the last snapshot */
+    struct metrics_sample *prev; /* the one before, for the rates */
+    struct metrics_sample *next; /* the snapshot being read, only kept if complete */
+    __u32 *keys;                 /* scratch space of the batched lookups */
+    void *values;
+    /* Cost of the last snapshot */
+    __u64 snapshot_ns;
+    __u32 snapshot_syscalls;
+    __u64 snapshots;
+    /* What the last conntrack sweep found and what it cost */
+    __u64 ct_flows;
+    __u32 ct_max_flows;
+    __u64 ct_swept;
+    __u64 ct_sweep_ns;
+    __u32 ct_sweep_syscalls;
+    /* The endpoint */
+    int listen_fd; /* -1 when not serving */
+    struct event_source listen;
+    char listen_addr[INET6_ADDRSTRLEN];
+    __u16 listen_port;
+    struct metrics_client clients[METRICS_MAX_CLIENTS];
+    __u64 scrapes;
+    __u64 render_ns; /* time the last page took to render */
+};
+
+int metrics_init(struct metrics *m, struct lb_state *st, int epoll_fd);
+void metrics_free(struct metrics *m);
+
+/* Serve the metrics on `addr`:`port` from now on, port 0 stops serving */
+int metrics_listen(struct metrics *m, const char *addr, __u16 port);
+
+/* Read the counters of the data plane into m->cur with a few batched lookups
+ * and keep the previous snapshot for the rates. A snapshot that fails halfway
+ * changes neither. Also closes clients that take too long.
+ */
+int metrics_snapshot(struct metrics *m);
+
+/* Record what a conntrack sweep found and what it cost */
+void metrics_set_conntrack(struct metrics *m, __u64 flows, __u32 max_flows, __u64 swept,
+                           __u64 sweep_ns, __u32 sweep_syscalls);
+
+#endif // METRICS_H_
@@ -0,0 +1,124 @@
+#!/bin/bash
+
+# Upgrades a running l4_lb in place while the host sends UDP packets to the
+# first IPv4 VIP. Neither ns1 nor the backends have a socket on the VIP, so
+# every packet ends up as UdpNoPorts somewhere: in ns1 if it missed the load
+# balancer, in a backend namespace if it was forwarded. The upgrade is hitless
+# if ns1 saw none of them and the backends saw all of them.
+#
+# Run it after create-topo.sh with l4_lb already running in ns1:
+#   sudo ip netns exec ns1 ./l4_lb -i veth1_ -c config.yaml &
+#   ./upgrade-test.sh [packets per second] [seconds]
+
+COLOR_RED='\033[0;31m'
+COLOR_GREEN='\033[0;32m'
+COLOR_OFF='\033[0m' # No Color
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+RATE=${1:-10000}
+DURATION=${2:-5}
+
+set -e
+
+yaml=$(cat ${DIR}/config.yaml)
+num_services=$(echo "$yaml" | shyaml get-length services)
+vip=""
+port=""
+for (( i=0; i<$num_services; i++ )); do
+    svc_vip=$(echo "$yaml" | shyaml get-value services.$i.vip)
+    svc_proto=$(echo "$yaml" | shyaml get-value services.$i.proto)
+    if [[ "$svc_vip" != *:* && "$svc_proto" == "udp" ]]; then
+      vip=$svc_vip
+      port=$(echo "$yaml" | shyaml get-value services.$i.port 9000)
+      break
+    fi
+done
+
+if [ -z "$vip" ]; then
+  echo -e "${COLOR_RED} ERROR: config.yaml has no IPv4 UDP service ${COLOR_OFF}" >&2
+  exit 1
+fi
+
+PIN_LINK=/sys/fs/bpf/l4_lb/link
+num_backends=$(echo "$yaml" | shyaml get-length backends)
+
+function no_ports {
+  sudo ip netns exec $1 nstat -asz UdpNoPorts | awk '/UdpNoPorts/ {print $2}'
+}
+
+# the backends live in ns2 and up, see create-topo.sh
+function delivered {
+  local total=0
+  for (( i=0; i<$num_backends-1; i++ )); do
+    total=$((total + $(no_ports ns$((i+2)))))
+  done
+  echo $total
+}
+
+function link_prog_id {
+  sudo bpftool -j link show pinned ${PIN_LINK} | python3 -c 'import json, sys; print(json.load(sys.stdin)["prog_id"])'
+}
+
+if ! sudo test -e ${PIN_LINK}; then
+  echo -e "${COLOR_RED} ERROR: no l4_lb link pinned at ${PIN_LINK} ${COLOR_OFF}" >&2
+  exit 1
+fi
+
+prog_before=$(link_prog_id)
+missed_before=$(no_ports ns1)
+delivered_before=$(delivered)
+
+# a paced sender, so that the upgrade happens in the middle of the traffic
+python3 - "$vip" "$port" "$RATE" "$DURATION" <<'EOF' > /tmp/upgrade-test.sent &
+import socket, sys, time
+vip, port, rate, duration = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), float(sys.argv[4])
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sent = 0
+start = time.monotonic()
+while time.monotonic() - start < duration:
+    # a new source port every 64 packets spreads the load over the backends
+    if sent % 64 == 0:
+        sock.close()
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.sendto(b"upgrade-test", (vip, port))
+    sent += 1
+    ahead = sent / rate - (time.monotonic() - start)
+    if ahead > 0:
+        time.sleep(ahead)
+print(sent)
+EOF
+sender=$!
+
+sleep $(echo "$DURATION / 2" | bc -l)
+echo -e "${COLOR_GREEN} Upgrading l4_lb ${COLOR_OFF}"
+sudo ip netns exec ns1 ${DIR}/l4_lb --upgrade -i veth1_ -c ${DIR}/config.yaml > /tmp/upgrade-test.log 2>&1 &
+upgrade=$!
+wait $sender
+# let the last packets reach the backends
+sleep 1
+
+sent=$(cat /tmp/upgrade-test.sent)
+missed=$(($(no_ports ns1) - missed_before))
+received=$(($(delivered) - delivered_before))
+prog_after=$(link_prog_id)
+
+echo "sent ${sent} packets to ${vip}:${port}, ${received} reached the backends, ${missed} missed the load balancer"
+failed=0
+if ! ps -p $upgrade > /dev/null; then
+  echo -e "${COLOR_RED} The new l4_lb exited, see below ${COLOR_OFF}"
+  cat /tmp/upgrade-test.log
+  failed=1
+fi
+if [ "$prog_after" == "$prog_before" ]; then
+  echo -e "${COLOR_RED} The pinned link still runs program ${prog_before} ${COLOR_OFF}"
+  failed=1
+fi
+if [ "$missed" -ne 0 ] || [ "$received" -ne "$sent" ]; then
+  echo -e "${COLOR_RED} The upgrade was not hitless ${COLOR_OFF}"
+  failed=1
+fi
+if [ "$failed" -ne 0 ]; then
+  exit 1
+fi
+echo -e "${COLOR_GREEN} The upgrade was hitless, the new l4_lb keeps running ${COLOR_OFF}"